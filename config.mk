@@ -2,3 +2,4 @@ VERSION = 0.1.0
 PREFIX = /usr/local
 MANPREFIX = ${PREFIX}/share/man
 CC = cc -static
+LIBS = -pthread
@@ -1,11 +1,47 @@
 // see LICENSE file for copyright and license details
 
+#include <stddef.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// allocation tags, see mem_alloc()
+#define MEM_PARSE                   0
+#define MEM_LAYOUT                  1
+#define MEM_RENDER                  2
+#define MEM_TRACE                   3
+#define MEM_SEARCH                  4
+#define MEM_SYNTAX                  5
+#define NB_MEM_TAGS                 6
+
+// termbox hooks: its allocations are accounted as rendering, its spans traced
+#define tb_malloc(size)             mem_alloc((size), MEM_RENDER)
+#define tb_realloc(ptr, size)       mem_realloc((ptr), (size), MEM_RENDER)
+#define tb_free(ptr)                _free(ptr)
+#define tb_trace_begin()            now_us()
+#define tb_trace_end(name, start)   trace_span((name), (start), -1, -1)
+void *mem_alloc(size_t size, int tag);
+void *mem_realloc(void *ptr, size_t size, int tag);
+void _free(void *ptr);
+int64_t now_us(void);
+void trace_span(const char *name, int64_t start, int slide, int width);
 
 #define TB_IMPL
+#define TB_OPT_CAP_CACHE
+#define TB_OPT_EGC
+#define TB_OPT_WRITER_THREAD
 #include "termbox.h"
 
 #define ERR_FILE_CONNECTION         1
@@ -16,14 +52,29 @@
 #define VERSION                     "0.1.0"
 #define HELP_MESSAGE                "Help available at https://jacquin.xyz/gmip"
 
-#define DEFAULT_TITLE               argv[1]
+#define DEFAULT_TITLE               filename
 #define DEFAULT_AUTHOR              ""
 #define PADDING                     0
 #define MIN_WIDTH                   8
 #define MAX_WIDTH                   55
 #define MIN_HEIGHT                  8
-#define DEFAULT_BUF_SIZE            4
 #define DEFAULT_CHARS_SIZE          (1 << 7)
+#define READ_SIZE                   (1 << 12)
+#define MAP_CHUNK                   (1 << 16)
+#if SIZE_MAX > 0xffffffff
+#define TABLE_RESERVE               ((size_t) 1 << 40)
+#else
+#define TABLE_RESERVE               ((size_t) 1 << 28)
+#endif
+#define SPINNER_MS                  100
+#define MAX_DEFERRED                64
+#define SCROLL_MARGIN               16
+#define PRE_CHECKPOINT              64
+#define MAX_CLUSTER                 8
+#define SYNTAX_BUCKETS              1024
+#define LOADED_BUCKETS              1024
+#define HUD_HISTORY                 16
+#define TRACE_RING_SIZE             (1 << 14)
 
 #define TERM_256_COLORS_SUPPORT
 
@@ -36,6 +87,13 @@
 #define COLOR_HEADING               99
 #define COLOR_LIST                  COLOR_LINK
 #define COLOR_QUOTE                 172
+#define COLOR_KEYWORD               141
+#define COLOR_STRING                114
+#define COLOR_COMMENT               244
+#define COLOR_NUMBER                173
+#define COLOR_ADDED                 71
+#define COLOR_REMOVED               167
+#define COLOR_HUNK                  74
 #define COLOR_BG                    TB_DEFAULT
 
 // 8 colors mode: available colors are TB_BLACK, TB_RED, TB_GREEN, TB_YELLOW,
@@ -48,9 +106,26 @@
 #define COLOR_HEADING               TB_YELLOW
 #define COLOR_LIST                  TB_YELLOW
 #define COLOR_QUOTE                 TB_YELLOW
+#define COLOR_KEYWORD               TB_YELLOW
+#define COLOR_STRING                TB_GREEN
+#define COLOR_COMMENT               TB_BLUE
+#define COLOR_NUMBER                TB_MAGENTA
+#define COLOR_ADDED                 TB_GREEN
+#define COLOR_REMOVED               TB_RED
+#define COLOR_HUNK                  TB_CYAN
 #define COLOR_BG                    TB_DEFAULT
 #endif
 
+// classes of the bytes of highlighted blocks, see lex_line()
+#define SYN_PLAIN                   0
+#define SYN_KEYWORD                 1
+#define SYN_STRING                  2
+#define SYN_COMMENT                 3
+#define SYN_NUMBER                  4
+#define SYN_ADDED                   5
+#define SYN_REMOVED                 6
+#define SYN_HUNK                    7
+
 #define MIN(A, B)                   (((A) < (B)) ? (A) : (B))
 #define MAX(A, B)                   (((A) > (B)) ? (A) : (B))
 #define MAP(A, B, C)                (MAX(B, MIN(A, C)))
@@ -60,12 +135,195 @@
 
 struct line {                       // list of lines
     char *chars;                    // pointer to UTF-8, NULL-ended string
+    const uint8_t *syntax;          // class of each byte, NULL if plain
     struct line *next;              // pointer to next line
 };
 
+struct lexer {                      // language of fenced blocks
+    const char *names;              // alt texts selecting it, space separated
+    const char *keywords;           // space separated
+    const char *comment;            // starting a comment up to the line end
+    const char *open, *close;       // around multi-line blocks of class block
+    int block;
+    const char *quotes;             // string delimiters
+    const char *marks;              // first characters giving their class,
+                                    // from SYN_ADDED on, to the whole line
+};
+
+struct syntax_block {               // fenced block highlighted
+    uint64_t hash;                  // of its language and lines
+    const struct lexer *lx;
+    int nb_lines;
+    size_t size;                    // bytes of its lines, '\0' included
+    int refs;                       // blocks of the deck using it
+    uint8_t **lines;                // class of each byte of each line, all
+                                    // right after it
+    char *text;                     // then its lines, one after the other
+    struct syntax_block *next;      // next block in the same bucket
+};
+
 struct slide {
-    struct line *start;
+    union {
+        struct line *start;
+        size_t offset;              // window mode: its first byte in the
+                                    // deck, lines being loaded up to the
+                                    // next slide, see load_slide()
+    };
+    int nb_parts;
+    int ascii;                      // only ASCII bytes, a cell each
+};
+
+struct loaded {                     // slide loaded in window mode
+    struct slide s;                 // with its lines
+    int index;
+    size_t bytes;                   // memory taken
+    struct loaded *newer, *older;   // LRU list, NULL at ends
+    struct loaded *next;            // in the same bucket of loaded
+};
+
+struct parser {                     // deck being read, see parse_more()
+    int fd;                         // -1 once the whole deck is read
+    const char *map;                // deck mapped in window mode, else NULL
+    size_t map_size, pos;           // bytes mapped, bytes read
+    size_t line_start, line_end;    // line being handled, in the deck
+    int error;                      // exit code if the deck is invalid
+    pthread_t thread;               // reading the deck after the first slide
+    int started;                    // thread started, see parse_start()
+    pthread_mutex_t lock;           // held while parsing, see sync_deck()
+    int notify[2];                  // pipe waking the main thread up
+    struct slide *buf;              // slides read, then the one being read
+    size_t nb_slides, buf_size, buf_reserved;   // sizes in bytes, see grow()
+    struct heading *headings;       // outline
+    size_t nb_headings, headings_size, headings_reserved;
+    char title[4*MAX_WIDTH + 1], author[4*MAX_WIDTH + 1];
+    char *chars;                    // line being read, ml bytes
+    size_t ml, chars_size;
+    int need;                       // continuation bytes still expected
+    struct line *last_line;
+    int preformatted_mode;
+    struct line *fence;             // opening the block being read
+    const struct lexer *lexer;      // highlighting it, NULL if none
+    int64_t load_start, slide_start;
+};
+
+struct combining {                  // mark drawn over a laid out cell
+    int cell;                       // in lay.ch
+    uint32_t ch;
+};
+
+struct word {                       // word of a line, see segment_slide()
+    int start, end;                 // its first and last positions, + 1
+    int x, e;                       // columns it starts and ends at, were
+                                    // the line a single row
+};
+
+struct layout_line {                // line of a slide, see segment_slide()
+    const char *chars;
+    const uint8_t *syntax;
+    int row;                        // rows the lines before wrap to
+    int cp, len;                    // its first code point in lay.cps and
+                                    // their number, or bytes if lay.ascii,
+                                    // positions being counted in those
+    int word, nb_words;             // its words in lay.words
+    int preformatted;               // in a preformatted block, unwrapped
+    int cols, marks;                // if so, its columns, and its first
+                                    // checkpoint in lay.marks
+};
+
+struct layout {                     // slide laid out, see layout_rows()
+    int index, dw;                  // what lines were indexed for
+    int ascii;                      // laid out a byte per cell
+    uint32_t *cps;                  // otherwise, code points of the lines,
+    int *at;                        // decoded once, the byte each starts at
+    uint8_t *widths;                // and the columns each takes
+    size_t cps_size;                // code points they have room for
+    struct word *words;             // words of the lines, in order
+    size_t words_size;
+    struct layout_line *lines;      // then one more with the rows in total
+    int nb_lines;
+    size_t lines_size;
+    int *ends;                      // rows displayed up to each part
     int nb_parts;
+    size_t ends_size;
+    int *marks;                     // code point and column of the
+                                    // characters of preformatted lines
+                                    // covering every PRE_CHECKPOINT-th
+                                    // column
+    size_t marks_size;
+    int cols;                       // columns of the widest of those lines
+    int height, hscroll;            // what rows were laid out for
+    char query[4*MAX_WIDTH + 1];    // query highlighted in them
+    int first, nb_rows;             // rows laid out, dw cells each
+    int top;                        // first row on screen
+    int shown;                      // parts on screen, 0 if anything else
+    uint32_t *ch;                   // cells, row by row, 0 right of wide
+    uintattr_t *fg, *bg;            // characters, with room for the rows of
+                                    // a screen and its margins, see resize()
+    uint8_t *hl;                    // highlighted cells of the row being
+                                    // laid out
+    struct combining *combining;    // marks of the cells, in cell order
+    int nb_combining, combining_size;
+};
+
+struct step {                       // frame of a single step, rendered ahead
+    struct tb_frame *frame;
+    int index, parts;               // slide and parts it displays
+};
+
+struct heading {                    // entry of the outline
+    const char *chars;              // heading text, without '#' and spaces,
+                                    // ended by '\n' if in the mapped deck
+    int slide, part, lvl;           // position in the deck, heading level
+};
+
+struct search_line {                // line of the deck, as indexed
+    const char *chars;
+    int slide, part;                // position in the deck
+};
+
+struct search_index {               // trigram index of every line of the deck
+    struct search_line *lines;
+    size_t nb_lines;                // less than 2^40, see build_index()
+    uint32_t *keys;                 // distinct lowercased trigrams, sorted
+    size_t *starts;                 // postings of keys[i] start at starts[i]
+    size_t *postings;               // line numbers, sorted for each trigram
+    size_t nb_keys;
+    int nb_slides;                  // slides indexed
+};
+
+struct frame_stats {                // timings of a displayed frame
+    int64_t layout_us;              // time spent in display_slide
+    int64_t present_us;             // time spent in tb_present
+    size_t bytes;                   // bytes written to the terminal
+    int cells;                      // cells changed on the terminal
+};
+
+union mem_header {                  // prefix of every accounted block
+    struct {
+        size_t size;
+        int tag;
+    } info;
+    max_align_t align;
+};
+
+struct mem_stats {                  // allocation accounting of a subsystem
+    uint64_t allocs, frees;
+    uint64_t bytes;                 // bytes ever allocated
+    uint64_t live, peak;            // bytes currently allocated, maximum
+};
+
+struct trace_event {                // completed span, in microseconds
+    const char *name;
+    int64_t ts, dur;
+    int slide, width;               // arguments, -1 when irrelevant
+};
+
+struct trace_ring {                 // per-thread ring of the latest spans
+    struct trace_event events[TRACE_RING_SIZE];
+    uint64_t head;                  // number of spans ever recorded
+    int tid;
+    atomic_int busy;                // a span being recorded
+    struct trace_ring *next;        // next ring in trace_rings
 };
 
 
@@ -73,20 +331,138 @@ struct slide {
 
 int utf8_char_length(char c);
 uint32_t unicode(const char *chars, int k, int len);
-void *_malloc(int size);
+int char_width(uint32_t c);
+int decode_utf8(const char *chars, int len, uint32_t *cps, int *at,
+    uint8_t *widths);
+void mem_count(int tag, size_t size, int freed);
+void *_malloc(size_t size, int tag);
+void *_mallocn(size_t n, size_t size, int tag);
+void *reserve(size_t *size);
+void grow(void *table, size_t *size, size_t reserved, size_t needed);
+void mem_report(void);
+void trace_dump(void);
 void resize(int w, int h);
-struct slide *parse_file(const char *filename);
-void display_slide(const struct slide s, int index, int nb_parts);
+char *copy_chars(const char *chars, size_t ml);
+void add_heading(const char *chars, size_t slide, int part);
+void new_slide(size_t n);
+const struct lexer *lexer_for(const char *alt);
+int is_keyword(const char *keywords, const char *word, size_t n);
+int lex_line(const struct lexer *lx, const char *chars, uint8_t *syn,
+    int state);
+void highlight_block(struct line *first, const struct line *end,
+    const struct lexer *lx);
+int same_block(const struct syntax_block *b, const struct line *first,
+    const struct line *end);
+void unref_block(const uint8_t *syntax);
+void handle_fence(struct line *line, int preformatted_mode,
+    struct line **fence, const struct lexer **lx);
+void parse_open(const char *filename);
+void parse_line(int reached_EOF);
+int parse_more(void);
+void *parse_run(void *arg);
+void parse_start(void);
+void sync_deck(struct slide **buf);
+void release(size_t from, size_t to);
+int kept_line(const char *chars, size_t ml, int *preformatted_mode);
+void lru_unlink(struct loaded *l);
+void evict(struct loaded *l);
+struct slide *load_slide(struct slide *buf, int index);
+uint32_t trigram(const char *chars);
+int compare_pairs(const void *a, const void *b);
+void build_index(const struct slide *buf);
+int contains(const char *chars, size_t len);
+void search(const struct slide *buf);
+void next_hit(int dir, int *index, int *parts);
+int slide_hit(int index, int min_part, int last);
+void window_hit(int dir, int *index, int *parts);
+int highlighted(const char *chars, int kc, int *hl_start, int *hl_end);
+int text_width(const char *chars);
+int text_row(int x, const char *chars, uintattr_t fg);
+void display_metadata(const char *ruler);
+int line_style(const char *chars, int preformatted_mode, int *accent,
+    int *color);
+int fit_chars(const struct layout_line *line, int kc, int end, int *j);
+int wrap_row(const struct layout_line *line, int kc, int lvl, uint32_t *ch,
+    uint8_t *hl, int *hl_start, int *hl_end);
+void fill_row(uint32_t *ch, uint8_t *hl, int j, int lvl, int marks);
+void add_combining(int cell, uint32_t c);
+int segment_line(const struct layout_line *line, int kc, struct word *wd);
+void segment_slide(const struct slide s, int index);
+void index_slide(void);
+void clip_row(const struct layout_line *line, int col, uint32_t *ch,
+    uintattr_t *fg, uint8_t *hl);
+void layout_rows(int first, int hscroll);
+void combine_rows(int a, int b, int y);
+void display_slide(const struct slide s, int index, int nb_parts,
+    int *scroll, int *hscroll);
+void display_outline(int selected);
+void display_prompt(void);
+void display_hud(int index);
+void step(const struct slide *buf, int di, int *index, int *parts);
+void render_step(struct slide *buf, int i, int index, int parts);
+void format_ruler(char *ruler, int index);
+void wait_input(struct tb_event *ev, struct slide **buf);
 
 
 // GLOBALS VARIABLES
 
-int nb_slides;
+int nb_slides;                      // slides read entirely
+struct parser parser;
+size_t window_cap = SIZE_MAX;       // memory of loaded slides, window mode
+size_t window_bytes;                // memory of loaded slides
+struct loaded *loaded[LOADED_BUCKETS]; // loaded slides, by index
+struct loaded *lru_newest, *lru_oldest; // the same, see load_slide()
+int loading;                        // deck still being read
+int want = -1;                      // slide waited for, -1 if none
+struct heading *headings;           // outline, read so far
+int nb_headings;
+char query[4*MAX_WIDTH + 1];        // search query, highlighted when set
+int query_len;
+struct search_index idx;            // grown by searches, see build_index()
+size_t *hits, nb_hits;              // indexed lines matching the query
 char title[4*MAX_WIDTH + 1], author[4*MAX_WIDTH + 1];
 int width, height;                  // terminal size
 int offset, dw;                     // offset, displayed width
+struct layout lay;                  // slide shown, laid out
+struct layout ahead;                // last step rendered ahead, laid out
+struct step steps[2];               // next and previous steps
+uint32_t *row_ch;                   // metadata row being drawn, width cells
+uintattr_t *row_fg, *row_bg;
+struct syntax_block *syntax_cache[SYNTAX_BUCKETS]; // blocks highlighted,
+                                    // by whoever makes lines: the parser, or
+                                    // load_slide() in window mode
+const struct lexer lexers[] = {
+    {"c h cpp c++", "auto break case char const continue default do double "
+        "else enum extern float for goto if inline int long register "
+        "return short signed sizeof static struct switch typedef union "
+        "unsigned void volatile while NULL", "//", "/*", "*/", SYN_COMMENT,
+        "\"'", NULL},
+    {"sh bash shell zsh console", "case do done elif else esac exit export "
+        "fi for function if in local read return set shift then unset until "
+        "while", "#", NULL, NULL, SYN_PLAIN, "\"'", NULL},
+    {"python py", "and as assert break class continue def del elif else "
+        "except False finally for from global if import in is lambda None "
+        "nonlocal not or pass raise return self True try while with yield",
+        "#", "\"\"\"", "\"\"\"", SYN_STRING, "\"'", NULL},
+    {"diff patch", "", NULL, NULL, NULL, SYN_PLAIN, NULL, "+-@"},
+};
+uintattr_t syntax_colors[] = {COLOR_DEFAULT, COLOR_KEYWORD, COLOR_STRING,
+    COLOR_COMMENT, COLOR_NUMBER, COLOR_ADDED, COLOR_REMOVED, COLOR_HUNK};
 char utf8_start[4] = {0, 0xc0, 0xe0, 0xf0};
 char masks[4] = {0x7f, 0x1f, 0x0f, 0x07};
+int mem_stats;                      // --mem-stats given, set before the first
+                                    // allocation
+struct mem_stats mem[NB_MEM_TAGS + 1]; // per tag, then sum of every tag
+pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+int show_hud;                       // frame timing overlay toggle
+struct frame_stats hud[HUD_HISTORY]; // rolling history of frame timings
+int hud_frames;                     // number of frames recorded in hud
+FILE *trace_file;                   // --trace output, NULL when not tracing
+int64_t trace_epoch;                // origin of trace timestamps
+_Atomic(struct trace_ring *) trace_rings;   // rings of every traced thread
+atomic_int trace_tids;              // number of traced threads
+atomic_int trace_stopped;           // spans no longer recorded, being dumped
+_Thread_local struct trace_ring *trace_ring;
 
 
 // FUNCTION DEFINITIONS, MAIN
@@ -94,19 +470,19 @@ char masks[4] = {0x7f, 0x1f, 0x0f, 0x07};
 int
 utf8_char_length(char c)
 {
-    // compute the length in bytes of UTF8 character starting by byte c
+    // compute the length in bytes of UTF8 character starting by byte c, 0 if
+    // c can not start one
 
     if ((char) (c & (char) 0x80) == utf8_start[0]) {
         return 1;
-    } else if ((char) (c & (char) 0xc0) == utf8_start[1]) {
+    } else if ((char) (c & (char) 0xe0) == utf8_start[1]) {
         return 2;
-    } else if ((char) (c & (char) 0xe0) == utf8_start[2]) {
+    } else if ((char) (c & (char) 0xf0) == utf8_start[2]) {
         return 3;
-    } else if ((char) (c & (char) 0xf0) == utf8_start[3]) {
+    } else if ((char) (c & (char) 0xf8) == utf8_start[3]) {
         return 4;
     } else {
-        exit(ERR_UNICODE_OR_UTF8);
-        return ERR_UNICODE_OR_UTF8;
+        return 0;
     }
 }
 
@@ -127,14 +503,176 @@ unicode(const char *chars, int k, int len)
     return res;
 }
 
+int
+char_width(uint32_t c)
+{
+    // compute the columns taken by codepoint c on the terminal, 0 for marks
+    // combining with the previous character; unprintable ones take one cell,
+    // as tb_present() draws them
+
+    int w = tb_wcwidth(c);
+
+    return (w < 0) ? 1 : w;
+}
+
+int
+decode_utf8(const char *chars, int len, uint32_t *cps, int *at,
+    uint8_t *widths)
+{
+    // decode the len bytes of UTF-8 string chars into cps, with the byte
+    // each code point starts at in at and its columns in widths, return
+    // their number; runs of ASCII bytes, a column each, are widened 16 at a
+    // time
+
+    int k = 0, n = 0, l;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i four = _mm_set1_epi32(4);
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i v, lo, hi, pos;
+#endif
+
+    while (k < len) {
+        if ((unsigned char) chars[k] >= 0x80) {
+            l = utf8_char_length(chars[k]);
+            at[n] = k;
+            cps[n] = unicode(chars, k, l);
+            widths[n] = char_width(cps[n]);
+            n++;
+            k += l;
+            continue;
+        }
+#ifdef __SSE2__
+        for (; k + 16 <= len; k += 16, n += 16) {
+            v = _mm_loadu_si128((const __m128i *) &(chars[k]));
+            if (_mm_movemask_epi8(v))
+                break;
+            lo = _mm_unpacklo_epi8(v, zero);
+            hi = _mm_unpackhi_epi8(v, zero);
+            _mm_storeu_si128((__m128i *) &(cps[n]),
+                _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128((__m128i *) &(cps[n + 4]),
+                _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128((__m128i *) &(cps[n + 8]),
+                _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128((__m128i *) &(cps[n + 12]),
+                _mm_unpackhi_epi16(hi, zero));
+            pos = _mm_setr_epi32(k, k + 1, k + 2, k + 3);
+            _mm_storeu_si128((__m128i *) &(at[n]), pos);
+            _mm_storeu_si128((__m128i *) &(at[n + 4]),
+                pos = _mm_add_epi32(pos, four));
+            _mm_storeu_si128((__m128i *) &(at[n + 8]),
+                pos = _mm_add_epi32(pos, four));
+            _mm_storeu_si128((__m128i *) &(at[n + 12]),
+                _mm_add_epi32(pos, four));
+            _mm_storeu_si128((__m128i *) &(widths[n]), one);
+        }
+#endif
+        // ASCII bytes left before the next multibyte character
+        for (; k < len && (unsigned char) chars[k] < 0x80; k++, n++) {
+            at[n] = k;
+            cps[n] = chars[k];
+            widths[n] = 1;
+        }
+    }
+
+    return n;
+}
+
+void
+mem_count(int tag, size_t size, int freed)
+{
+    // account an allocation or a release of size bytes to tag and the total
+
+    struct mem_stats *m;
+    int i;
+
+    if (!mem_stats)
+        return;
+    pthread_mutex_lock(&mem_lock);
+    for (i = 0; i < 2; i++) {
+        m = &mem[i ? NB_MEM_TAGS : tag];
+        if (freed) {
+            m->frees++;
+            m->live -= size;
+        } else {
+            m->allocs++;
+            m->bytes += size;
+            m->live += size;
+            m->peak = MAX(m->peak, m->live);
+        }
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+void *
+mem_alloc(size_t size, int tag)
+{
+    // allocate size bytes accounted to tag, return NULL on failure; blocks
+    // are only prefixed with a header and accounted with --mem-stats
+
+    union mem_header *h;
+
+    if (!mem_stats)
+        return malloc(size);
+    if ((h = malloc(sizeof(union mem_header) + size)) == NULL)
+        return NULL;
+    h->info.size = size;
+    h->info.tag = tag;
+    mem_count(tag, size, 0);
+
+    return h + 1;
+}
+
+void *
+mem_realloc(void *ptr, size_t size, int tag)
+{
+    // resize a block from mem_alloc, keeping its tag
+
+    union mem_header *h;
+    size_t old_size;
+
+    if (!mem_stats)
+        return realloc(ptr, size);
+    if (ptr == NULL)
+        return mem_alloc(size, tag);
+    h = (union mem_header *) ptr - 1;
+    old_size = h->info.size;
+    if ((h = realloc(h, sizeof(union mem_header) + size)) == NULL)
+        return NULL;
+    mem_count(h->info.tag, old_size, 1);
+    mem_count(h->info.tag, size, 0);
+    h->info.size = size;
+
+    return h + 1;
+}
+
+void
+_free(void *ptr)
+{
+    // release a block from mem_alloc
+
+    union mem_header *h;
+
+    if (!mem_stats) {
+        free(ptr);
+        return;
+    }
+    if (ptr == NULL)
+        return;
+    h = (union mem_header *) ptr - 1;
+    mem_count(h->info.tag, h->info.size, 1);
+    free(h);
+}
+
 void *
-_malloc(int size)
+_malloc(size_t size, int tag)
 {
-    // wrap a malloc call with error detection
+    // wrap a mem_alloc call with error detection
 
     void *res;
 
-    if ((res = malloc(size)) == NULL) {
+    if ((res = mem_alloc(size, tag)) == NULL) {
         tb_shutdown();
         exit(ERR_MALLOC);
     }
@@ -142,323 +680,2250 @@ _malloc(int size)
     return res;
 }
 
+void *
+_mallocn(size_t n, size_t size, int tag)
+{
+    // allocate an array of n elements of size bytes, at least one, with
+    // overflow detection
+
+    if (n > SIZE_MAX / size) {
+        tb_shutdown();
+        exit(ERR_MALLOC);
+    }
+
+    return _malloc(size * MAX(n, 1), tag);
+}
+
+void *
+reserve(size_t *size)
+{
+    // reserve address space for a table growing in place, see grow(); size
+    // is halved until it fits
+
+    void *table;
+
+    for (; *size >= (size_t) sysconf(_SC_PAGESIZE); *size >>= 1) {
+        table = mmap(NULL, *size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (table != MAP_FAILED)
+            return table;
+    }
+    exit(ERR_MALLOC);
+}
+
+void
+grow(void *table, size_t *size, size_t reserved, size_t needed)
+{
+    // make at least the first needed bytes of table usable, size being the
+    // bytes usable so far; the table never moves, so that it can be read
+    // while it grows
+
+    size_t page = sysconf(_SC_PAGESIZE), n;
+
+    if (needed <= *size)
+        return;
+    n = MIN(MAX((needed + page - 1)/page*page, 2 * *size), reserved);
+    if (needed > reserved || mprotect(table, n, PROT_READ | PROT_WRITE) < 0) {
+        tb_shutdown();
+        exit(ERR_MALLOC);
+    }
+    mem_count(MEM_PARSE, n - *size, 0);
+    *size = n;
+}
+
+void
+mem_report(void)
+{
+    // print allocation accounting on stderr
+
+    static const char *names[NB_MEM_TAGS + 1] = {"parse", "layout", "render",
+        "trace", "search", "syntax", "total"};
+    const struct mem_stats *m;
+    int i;
+
+    fprintf(stderr, "%-8s %12s %12s %16s %16s %16s\n", "memory", "allocs",
+        "frees", "bytes", "live", "peak");
+    for (i = 0; i <= NB_MEM_TAGS; i++) {
+        m = &mem[i];
+        fprintf(stderr, "%-8s %12llu %12llu %16llu %16llu %16llu\n", names[i],
+            (unsigned long long) m->allocs, (unsigned long long) m->frees,
+            (unsigned long long) m->bytes, (unsigned long long) m->live,
+            (unsigned long long) m->peak);
+    }
+}
+
+int64_t
+now_us(void)
+{
+    // read the monotonic clock, in microseconds
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+trace_span(const char *name, int64_t start, int slide, int width)
+{
+    // record a span from start to now in the ring of the calling thread
+
+    struct trace_ring *r;
+    struct trace_event *e;
+
+    if (trace_file == NULL)
+        return;
+    if ((r = trace_ring) == NULL) {
+        // first span of this thread: publish a new ring, without locking
+        r = trace_ring = _malloc(sizeof(struct trace_ring), MEM_TRACE);
+        r->head = 0;
+        r->tid = atomic_fetch_add(&trace_tids, 1) + 1;
+        atomic_init(&r->busy, 0);
+        r->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &r->next, r))
+            ;
+    }
+
+    // only the owning thread writes, oldest spans are overwritten, unless
+    // trace_dump() started reading them
+    atomic_store(&r->busy, 1);
+    if (!atomic_load(&trace_stopped)) {
+        e = &r->events[r->head++ % TRACE_RING_SIZE];
+        e->name = name;
+        e->ts = start;
+        e->dur = now_us() - start;
+        e->slide = slide;
+        e->width = width;
+    }
+    atomic_store(&r->busy, 0);
+}
+
+void
+trace_dump(void)
+{
+    // write the spans of every ring as Chrome trace event JSON, other
+    // threads such as the parser still running but no longer recording
+
+    struct trace_ring *r;
+    const struct trace_event *e;
+    const char *sep = "";
+    uint64_t k;
+
+    atomic_store(&trace_stopped, 1);
+    fprintf(trace_file, "{\"traceEvents\":[");
+    for (r = atomic_load(&trace_rings); r != NULL; r = r->next) {
+        while (atomic_load(&r->busy))
+            ;
+        k = (r->head > TRACE_RING_SIZE) ? r->head - TRACE_RING_SIZE : 0;
+        for (; k < r->head; k++) {
+            e = &r->events[k % TRACE_RING_SIZE];
+            fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                "\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":{", sep,
+                e->name, r->tid, (long long) (e->ts - trace_epoch),
+                (long long) e->dur);
+            if (e->slide >= 0)
+                fprintf(trace_file, "\"slide\":%d%s", e->slide,
+                    (e->width >= 0) ? "," : "");
+            if (e->width >= 0)
+                fprintf(trace_file, "\"width\":%d", e->width);
+            fprintf(trace_file, "}}");
+            sep = ",";
+        }
+    }
+    fprintf(trace_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(trace_file);
+}
+
 void
 resize(int w, int h)
 {
     // try to apply new size
 
+    struct layout *layouts[] = {&lay, &ahead}, *l;
+    size_t n;
+    int i;
+
     if ((width = w) < (2*PADDING + MIN_WIDTH) || (height = h) < MIN_HEIGHT) {
         tb_shutdown();
         exit(ERR_TERM_NOT_BIG_ENOUGH);
     }
     dw = MIN(width - 2*PADDING, MAX_WIDTH);
     offset = (width - dw) >> 1;
+    lay.shown = 0;
+    _free(row_ch);
+    _free(row_fg);
+    _free(row_bg);
+    row_ch = _malloc(sizeof(uint32_t) * width, MEM_LAYOUT);
+    row_fg = _malloc(sizeof(uintattr_t) * width, MEM_LAYOUT);
+    row_bg = _malloc(sizeof(uintattr_t) * width, MEM_LAYOUT);
+
+    // the rows laid out, so that moving around does not allocate
+    n = dw * (height - 2 + 2*SCROLL_MARGIN);
+    for (i = 0; i < 2; i++) {
+        l = layouts[i];
+        l->height = 0;
+        _free(l->ch);
+        _free(l->fg);
+        _free(l->bg);
+        _free(l->hl);
+        l->ch = _malloc(sizeof(uint32_t) * n, MEM_LAYOUT);
+        l->fg = _malloc(sizeof(uintattr_t) * n, MEM_LAYOUT);
+        l->bg = _malloc(sizeof(uintattr_t) * n, MEM_LAYOUT);
+        l->hl = _malloc(dw, MEM_LAYOUT);
+    }
 }
 
-struct slide *
-parse_file(const char *filename)
-{
-    // read the file, return its parsed content
-
-    FILE *file = NULL;
-    struct slide *buf, *new_buf;
-    struct line *line, *last_line;
-    char *chars, *new_chars;
-    int reached_EOF, preformatted_mode, buf_size, chars_size;
-    int c, ml, l, k;
-
-    // init variables
-    buf = _malloc(sizeof(struct slide) * (buf_size = DEFAULT_BUF_SIZE));
-    chars = _malloc((chars_size = DEFAULT_CHARS_SIZE));
-    nb_slides = 0;
-    reached_EOF = 0;
-    preformatted_mode = 0;
-    buf[nb_slides].start = NULL;
-    buf[nb_slides].nb_parts = 1;
+char *
+copy_chars(const char *chars, size_t ml)
+{
+    // copy the ml bytes of line chars into a NULL-ended string
 
-    // open connection to file
-    if ((file = fopen(filename, "r")) == NULL)
-        exit(ERR_FILE_CONNECTION);
+    char *copy = _malloc(ml + 1, MEM_PARSE);
 
-    // read content into memory
-    while (!reached_EOF) {
-        ml = 0;
-        while (1) { // store characters of a line in chars
-            if ((c = getc(file)) == EOF) {
-                reached_EOF = 1;
-                break;
-            } else if (c == '\n') {
-                break;
-            } else {
-                // potentially resize chars
-                l = utf8_char_length(c);
-                if (ml + l > chars_size) {
-                    while (ml + l > chars_size)
-                        chars_size <<= 1;
-                    new_chars = _malloc(chars_size);
-                    strncpy(new_chars, chars, ml);
-                    free(chars);
-                    chars = new_chars;
-                }
-                // store bytes with UTF-8 compliance check
-                chars[ml] = (char) c;
-                for (k = 1; k < l; k++) {
-                    if (((c = getc(file)) == EOF) ||
-                        (((char) c & (char) 0xc0) != (char) 0x80))
-                        exit(ERR_UNICODE_OR_UTF8);
-                    chars[ml + k] = (char) c;
-                }
-                ml += l;
-            }
-        }
-        
-        if (ml >= 3 && chars[0] == '`' && chars[1] == '`' && chars[2] == '`')
-            preformatted_mode ^= 1;
-        if (!preformatted_mode && (ml >= 3 && chars[0] == '-' && chars[1] == '-'
-            && chars[2] == '-') || reached_EOF) {
-            // closing the slide
-            nb_slides++;
-            if (nb_slides >= buf_size) {
-                while (nb_slides >= buf_size)
-                    buf_size <<= 1;
-                new_buf = _malloc(sizeof(struct slide) * buf_size);
-                for (k = 0; k < nb_slides; k++) {
-                    new_buf[k].start = buf[k].start;
-                    new_buf[k].nb_parts = buf[k].nb_parts;
-                }
-                free(buf);
-                buf = new_buf;
-            }
-            buf[nb_slides].start = NULL;
-            buf[nb_slides].nb_parts = 1;
-        } else if (!preformatted_mode && !strncmp("%title:", chars, 7)) {
-            strncpy(title, &(chars[7]), ml - 7);
-            title[ml - 7] = '\0';
-        } else if (!preformatted_mode && !strncmp("%author:", chars, 8)) {
-            strncpy(author, &(chars[8]), ml - 8);
-            author[ml - 8] = '\0';
-        } else if (!preformatted_mode && !strncmp("%date:", chars, 6)) {
-        } else {
-            // append the new line
-            line = _malloc(sizeof(struct line));
-            line->chars = _malloc(ml + 1);
-            strncpy(line->chars, chars, ml);
-            line->chars[ml] = '\0';
-            line->next = NULL;
-            if (buf[nb_slides].start == NULL) {
-                buf[nb_slides].start = last_line = line;
-            } else {
-                last_line->next = line;
-                last_line = line;
-            }
-            if (!preformatted_mode && ml >= 1 && chars[0] == '^')
-                buf[nb_slides].nb_parts++;
-        }
-    }
+    strncpy(copy, chars, ml);
+    copy[ml] = '\0';
 
-    // close connection to file
-    if (fclose(file) == EOF)
-        exit(ERR_FILE_CONNECTION);
+    return copy;
+}
 
-    // copy to correct size buffer, free everything
-    new_buf = _malloc(sizeof(struct slide) * nb_slides);
-    for (k = 0; k < nb_slides; k++) {
-        new_buf[k].start = buf[k].start;
-        new_buf[k].nb_parts = buf[k].nb_parts;
-    }
-    free(buf);
-    free(chars);
+void
+add_heading(const char *chars, size_t slide, int part)
+{
+    // append the heading line chars to the outline
+
+    struct heading *hd;
+    int lvl, k;
+
+    // slides are numbered with an int once displayed
+    if (slide >= INT_MAX)
+        return;
+    grow(parser.headings, &parser.headings_size, parser.headings_reserved,
+        sizeof(struct heading) * (parser.nb_headings + 1));
 
-    return new_buf;
+    // same level detection as display_slide
+    lvl = (chars[1] == '#') ? ((chars[2] == '#') ? 3 : 2) : 1;
+    for (k = 0; chars[k] == '#'; k++)
+        ;
+    while (chars[k] == ' ')
+        k++;
+    hd = &(parser.headings[parser.nb_headings++]);
+    hd->chars = &(chars[k]);
+    hd->slide = slide;
+    hd->part = part;
+    hd->lvl = lvl;
 }
 
 void
-display_slide(const struct slide s, int index, int nb_parts)
+new_slide(size_t n)
 {
-    // display slide s on the screen
+    // start slide n of the deck after the line being handled
 
-    uint32_t *ch = _malloc(sizeof(uint32_t) * dw * (height - 2));
-    uint16_t *fg = _malloc(sizeof(uint16_t) * 2 * (height - 2));
-    struct line *l;
-    char ruler[8];
-    int nb_lines, parts, nb_displayed_lines, h_offset;
-    int preformatted_mode = 0;
-    int accent, color, lvl;
-    int i, j, jlw, k, kc, kclw, len, w_offset;
+    grow(parser.buf, &parser.buf_size, parser.buf_reserved,
+        sizeof(struct slide) * (n + 1));
+    if (parser.map != NULL)
+        parser.buf[n].offset = parser.line_end;
+    else
+        parser.buf[n].start = NULL;
+    parser.buf[n].nb_parts = 1;
+    parser.buf[n].ascii = 1;
+}
 
-    // decompress slide
-    l = s.start;
-    k = nb_lines = 0;
-    parts = 0;
+const struct lexer *
+lexer_for(const char *alt)
+{
+    // find the language named by the first word of the alt text of a fence,
+    // NULL if none
 
-    // create buffer of decompressed lines
-    while (nb_lines < height - 2 && l != NULL) {
-        if (l->chars[0] == '`' && l->chars[1] == '`' && l->chars[2] == '`') {
-            preformatted_mode ^= 1;
-        } else if (!preformatted_mode && l->chars[0] == '^') {
-            if (++parts <= nb_parts)
-                nb_displayed_lines = nb_lines;
-        } else {
-            lvl = 0;
-            if (preformatted_mode) {
-                accent = color = COLOR_DEFAULT;
-            } else if (l->chars[0] == '=' && l->chars[1] == '>') {
-                accent = color = COLOR_LINK;
-            } else if (l->chars[0] == '#') {
-                lvl = (l->chars[1] == '#') ? ((l->chars[2] == '#') ? 3 : 2) : 1;
-                accent = color = COLOR_HEADING | ((lvl==1) ? TB_UNDERLINE : 0);
-            } else {
-                accent = color = COLOR_DEFAULT;
-                if (l->chars[0] == '*' && l->chars[1] == ' ') {
-                    accent = COLOR_LIST;
-                } else if (l->chars[0] == '>') {
-                    accent = COLOR_QUOTE;
-                }
-            }
-            kc = 0;
-            // hide '#' for headings
-            while (lvl && l->chars[kc] == '#')
-                kc++;
-            while (nb_lines < height - 2) {
-                // decompress to UTF-8, move to next character
-                while (l->chars[kc] == ' ')
-                    kc++;
-                kclw = kc;
-                j = jlw = 0;
-                while (l->chars[kc]) {
-                    if (j == dw) {
-                        if (l->chars[kc] != ' ' && jlw > 0) {
-                            // unprint word
-                            j = jlw;
-                            kc = kclw;
-                        }
-                        break;
-                    }
-                    if (l->chars[kc] == ' ') {
-                        // identify next start of word
-                        kclw = kc;
-                        while (l->chars[kclw] == ' ')
-                            kclw++;
-                        if (!(l->chars[kclw])) {
-                            kc = kclw;
-                            break;
-                        } else if (j + kclw - kc >= dw) {
-                            break;
-                        } else {
-                            // print spaces
-                            while (kc < kclw) {
-                                ch[k + (j++)] = ' ';
-                                kc++;
-                            }
-                        }
-                    } else {
-                        if (kc == kclw)
-                            jlw = j;
-                        len = utf8_char_length(l->chars[kc]);
-                        ch[k + (j++)] = unicode(l->chars, kc, len);
-                        kc += len;
-                    }
-                }
+    const char *p;
+    size_t n, k;
+    int i;
 
-                // center
-                if (((lvl == 1) || (lvl == 2)) && j < dw) {
-                    j += (w_offset = (dw - j)/2);
-                    for (i = j - 1; i >= w_offset; i--)
-                        ch[k + i] = ch[k + i - w_offset];
-                    while (i >= 0)
-                        ch[k + (i--)] = ' ';
-                }
+    while (*alt == ' ')
+        alt++;
+    for (n = 0; alt[n] && alt[n] != ' '; n++)
+        ;
+    for (i = 0; n > 0 && i < (int) (sizeof(lexers)/sizeof(lexers[0])); i++)
+        for (p = lexers[i].names; *p; p += k + (p[k] == ' ')) {
+            for (k = 0; p[k] && p[k] != ' '; k++)
+                ;
+            if (k == n && !strncasecmp(p, alt, n))
+                return &lexers[i];
+        }
 
-                // fill with ' '
-                while (j < dw)
-                    ch[k + (j++)] = ' ';
+    return NULL;
+}
 
-                // colors, nb_lines increment
-                fg[2*nb_lines] = accent;
-                accent = fg[2*nb_lines + 1] = color;
-                nb_lines++;
-                k += dw;
-                if (!(l->chars[kc]))
-                    break;
-            }
-        }
-        l = l->next;
+int
+is_keyword(const char *keywords, const char *word, size_t n)
+{
+    // tell if the n bytes of word are one of the space separated keywords
+
+    size_t k;
+
+    for (; *keywords; keywords += k + (keywords[k] == ' ')) {
+        for (k = 0; keywords[k] && keywords[k] != ' '; k++)
+            ;
+        if (k == n && !strncmp(keywords, word, n))
+            return 1;
     }
-    if (++parts <= nb_parts)
-        nb_displayed_lines = nb_lines;
 
-    // actual content printing
-    tb_clear();
-    h_offset = 1 + ((height - 2 - nb_lines) >> 1);
-    for (k = i = 0; i < nb_displayed_lines; i++) {
-        for (j = 0; j < dw; j++) {
-            tb_set_cell(offset + j, h_offset + i, ch[k++],
-                fg[2*i + ((j == 0) ? 0 : 1)], COLOR_BG);
+    return 0;
+}
+
+int
+lex_line(const struct lexer *lx, const char *chars, uint8_t *syn, int state)
+{
+    // classify each byte of line chars into syn, starting inside a
+    // multi-line block if state is set, return whether it ends inside one
+
+    const char *p;
+    size_t k = 0, n, len = strlen(chars);
+
+    memset(syn, SYN_PLAIN, len);
+    if (lx->marks != NULL) {
+        if (chars[0] && (p = strchr(lx->marks, chars[0])) != NULL)
+            memset(syn, SYN_ADDED + (p - lx->marks), len);
+        return 0;
+    }
+    while (k < len) {
+        if (state) {
+            p = strstr(&(chars[k]), lx->close);
+            n = (p == NULL) ? len : (size_t) (p - chars) + strlen(lx->close);
+            memset(&(syn[k]), lx->block, n - k);
+            state = p == NULL;
+        } else if (lx->open != NULL &&
+            !strncmp(&(chars[k]), lx->open, strlen(lx->open))) {
+            n = k + strlen(lx->open);
+            memset(&(syn[k]), lx->block, n - k);
+            state = 1;
+        } else if (lx->comment != NULL && (k == 0 || chars[k - 1] == ' ' ||
+            chars[k - 1] == '\t') &&
+            !strncmp(&(chars[k]), lx->comment, strlen(lx->comment))) {
+            n = len;
+            memset(&(syn[k]), SYN_COMMENT, n - k);
+        } else if (lx->quotes != NULL && strchr(lx->quotes, chars[k])) {
+            // up to the closing quote, skipping escaped characters
+            for (n = k + 1; n < len && chars[n] != chars[k]; n++)
+                if (chars[n] == '\\' && n + 1 < len)
+                    n++;
+            n = MIN(n + 1, len);
+            memset(&(syn[k]), SYN_STRING, n - k);
+        } else if (isalpha((unsigned char) chars[k]) || chars[k] == '_') {
+            for (n = k; n < len && (isalnum((unsigned char) chars[n]) ||
+                chars[n] == '_'); n++)
+                ;
+            if (is_keyword(lx->keywords, &(chars[k]), n - k))
+                memset(&(syn[k]), SYN_KEYWORD, n - k);
+        } else if (isdigit((unsigned char) chars[k])) {
+            for (n = k; n < len && (isalnum((unsigned char) chars[n]) ||
+                chars[n] == '.'); n++)
+                ;
+            memset(&(syn[k]), SYN_NUMBER, n - k);
+        } else {
+            n = k + 1;
         }
+        k = n;
     }
 
-    // metadata printing
-    tb_printf((width - strlen(title))/2, 0, COLOR_METADATA, COLOR_BG,
-        "%s", title);
-    tb_printf(0, height - 1, COLOR_METADATA, COLOR_BG, "%s", author);
-    sprintf(ruler, "%d/%d", index, nb_slides);
-    tb_printf(width - strlen(ruler), height - 1, COLOR_METADATA, COLOR_BG,
-        "%s", ruler);
+    return state;
+}
+
+void
+highlight_block(struct line *first, const struct line *end,
+    const struct lexer *lx)
+{
+    // classify the bytes of the lines of a fenced block, from first to end
+    // excluded, once for all the blocks of the deck with the same content
+
+    struct syntax_block *b;
+    struct line *l;
+    uint64_t hash = 14695981039346656037ULL;    // 64 bits FNV-1a
+    const char *c;
+    size_t size, len;
+    int n, state;
+
+    if (first == end)
+        return;
+    hash = (hash ^ (uint64_t) (lx - lexers)) * 1099511628211ULL;
+    for (n = 0, size = 0, l = first; l != end; l = l->next, n++)
+        for (c = l->chars; ; c++) {
+            hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+            size++;
+            if (*c == '\0')
+                break;
+        }
 
-    free(ch);
-    free(fg);
+    // the same hash may come from other lines: they are compared too
+    for (b = syntax_cache[hash % SYNTAX_BUCKETS]; b != NULL; b = b->next)
+        if (b->hash == hash && b->lx == lx && b->nb_lines == n &&
+            b->size == size && same_block(b, first, end))
+            break;
+    if (b == NULL) {
+        // classes, then lines, found from the first class by unref_block()
+        b = _malloc(sizeof(struct syntax_block) + 2*size, MEM_SYNTAX);
+        b->hash = hash;
+        b->lx = lx;
+        b->nb_lines = n;
+        b->size = size;
+        b->refs = 0;
+        b->lines = _malloc(sizeof(uint8_t *) * n, MEM_SYNTAX);
+        b->text = (char *) &(b[1]) + size;
+        for (state = n = 0, size = 0, l = first; l != end;
+            l = l->next, n++) {
+            len = strlen(l->chars) + 1;
+            b->lines[n] = (uint8_t *) &(b[1]) + size;
+            memcpy(&(b->text[size]), l->chars, len);
+            state = lex_line(lx, l->chars, b->lines[n], state);
+            size += len;
+        }
+        b->next = syntax_cache[hash % SYNTAX_BUCKETS];
+        syntax_cache[hash % SYNTAX_BUCKETS] = b;
+    }
+    b->refs++;
+    for (n = 0, l = first; l != end; l = l->next, n++)
+        l->syntax = b->lines[n];
 }
 
 int
-main(int argc, char *argv[])
+same_block(const struct syntax_block *b, const struct line *first,
+    const struct line *end)
 {
-    struct slide *buf;              // buffer of pointers to slides
-    struct tb_event ev;             // struct to retrieve events
-    int m = 0;                      // multiplier
-    int index = 0;
-    int displayed_parts = 1;
-    int di;
+    // tell if block b was highlighted for the lines from first to end
+    // excluded, of the same number and size as its own
 
-    // parsing arguments
-    if (argc < 2 || !(strcmp(argv[1], "--help") && strcmp(argv[1], "-h"))) {
-        printf("%s\n", HELP_MESSAGE);
-        return 0;
-    } else if (!(strcmp(argv[1], "--version") && strcmp(argv[1], "-v"))) {
-        printf("%s\n", VERSION);
-        return 0;
-    } else {
-        strcpy(title, DEFAULT_TITLE);
-        strcpy(author, DEFAULT_AUTHOR);
-        buf = parse_file(argv[1]);
+    const struct line *l;
+    size_t k;
+
+    for (k = 0, l = first; l != end; k += strlen(l->chars) + 1, l = l->next)
+        if (strcmp(&(b->text[k]), l->chars))
+            return 0;
+
+    return 1;
+}
+
+void
+unref_block(const uint8_t *syntax)
+{
+    // release the use of the highlighted block whose first line has the
+    // given classes, freeing it if it was the last one
+
+    struct syntax_block *b = (struct syntax_block *) syntax - 1, **p;
+
+    if (--b->refs > 0)
+        return;
+    for (p = &(syntax_cache[b->hash % SYNTAX_BUCKETS]); *p != b;
+        p = &((*p)->next))
+        ;
+    *p = b->next;
+    _free(b->lines);
+    _free(b);
+}
+
+void
+handle_fence(struct line *line, int preformatted_mode, struct line **fence,
+    const struct lexer **lx)
+{
+    // remember where a block opens with line and its language, or highlight
+    // it once line closes it
+
+    if (preformatted_mode) {
+        *fence = line;
+        *lx = lexer_for(&(line->chars[3]));
+    } else if (*lx != NULL) {
+        highlight_block((*fence)->next, line, *lx);
+        *lx = NULL;
     }
+}
 
-    // init termbox
-    tb_init();
-    tb_set_output_mode(OUTPUT_MODE);
-    tb_set_clear_attrs(COLOR_DEFAULT, COLOR_BG);
-    resize(tb_width(), tb_height());
+void
+parse_open(const char *filename)
+{
+    // start reading the deck from filename, or from stdin if it is "-"
 
-    // main loop
-    while (1) {
-        display_slide(buf[index], index + 1, displayed_parts);
-        tb_present();
-        tb_poll_event(&ev);
+    struct stat st;
+    void *map;
 
-        if (ev.type == TB_EVENT_RESIZE)
+    parser.load_start = parser.slide_start = now_us();
+    parser.buf_reserved = parser.headings_reserved = TABLE_RESERVE;
+    parser.buf = reserve(&parser.buf_reserved);
+    parser.headings = reserve(&parser.headings_reserved);
+    parser.chars = _malloc((parser.chars_size = DEFAULT_CHARS_SIZE),
+        MEM_PARSE);
+    strcpy(parser.title, title);
+    strcpy(parser.author, author);
+    pthread_mutex_init(&parser.lock, NULL);
+    if (pipe(parser.notify) < 0 ||
+        fcntl(parser.notify[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(parser.notify[1], F_SETFL, O_NONBLOCK) < 0)
+        exit(ERR_FILE_CONNECTION);
+
+    // open connection to file
+    if (!strcmp(filename, "-"))
+        parser.fd = STDIN_FILENO;
+    else if ((parser.fd = open(filename, O_RDONLY)) < 0)
+        exit(ERR_FILE_CONNECTION);
+
+    // window mode: slides are loaded from the mapped file when displayed
+    if (window_cap != SIZE_MAX && !fstat(parser.fd, &st) &&
+        S_ISREG(st.st_mode) && st.st_size > 0 && (map = mmap(NULL,
+        st.st_size, PROT_READ, MAP_PRIVATE, parser.fd, 0)) != MAP_FAILED) {
+        parser.map = map;
+        parser.map_size = st.st_size;
+    }
+    new_slide(0);
+}
+
+void
+parse_line(int reached_EOF)
+{
+    // handle the line read into parser.chars
+
+    struct line *line;
+    char *chars = parser.chars;
+    size_t ml = parser.ml;
+    size_t n = parser.nb_slides;
+
+    // ended, so that no prefix below matches bytes of a previous line
+    chars[ml] = '\0';
+    if (ml >= 3 && chars[0] == '`' && chars[1] == '`' && chars[2] == '`')
+        parser.preformatted_mode ^= 1;
+    if (!parser.preformatted_mode && (ml >= 3 && chars[0] == '-' &&
+        chars[1] == '-' && chars[2] == '-') || reached_EOF) {
+        // closing the slide
+        n = ++parser.nb_slides;
+        trace_span("parse", parser.slide_start, MIN(n, INT_MAX), -1);
+        parser.slide_start = now_us();
+        new_slide(n);
+    } else if (!parser.preformatted_mode && !strncmp("%title:", chars, 7)) {
+        ml = MIN(ml - 7, sizeof(parser.title) - 1);
+        strncpy(parser.title, &(chars[7]), ml);
+        parser.title[ml] = '\0';
+    } else if (!parser.preformatted_mode && !strncmp("%author:", chars, 8)) {
+        ml = MIN(ml - 8, sizeof(parser.author) - 1);
+        strncpy(parser.author, &(chars[8]), ml);
+        parser.author[ml] = '\0';
+    } else if (!parser.preformatted_mode && !strncmp("%date:", chars, 6)) {
+    } else if (parser.map != NULL) {
+        // window mode: only parts and headings are kept
+        if (!parser.preformatted_mode && ml >= 1 && chars[0] == '^')
+            parser.buf[n].nb_parts++;
+        else if (!parser.preformatted_mode && ml >= 1 && chars[0] == '#')
+            add_heading(&(parser.map[parser.line_start]), n,
+                parser.buf[n].nb_parts);
+    } else {
+        // append the new line
+        line = _malloc(sizeof(struct line), MEM_PARSE);
+        line->chars = copy_chars(chars, ml);
+        line->syntax = NULL;
+        line->next = NULL;
+        if (parser.buf[n].start == NULL)
+            parser.buf[n].start = parser.last_line = line;
+        else
+            parser.last_line = parser.last_line->next = line;
+        if (ml >= 3 && chars[0] == '`' && chars[1] == '`' && chars[2] == '`')
+            handle_fence(line, parser.preformatted_mode, &(parser.fence),
+                &(parser.lexer));
+        else if (!parser.preformatted_mode && ml >= 1 && chars[0] == '^')
+            parser.buf[n].nb_parts++;
+        else if (!parser.preformatted_mode && ml >= 1 && chars[0] == '#')
+            add_heading(line->chars, n, parser.buf[n].nb_parts);
+    }
+    parser.ml = 0;
+}
+
+int
+parse_more(void)
+{
+    // read and parse the next chunk of the deck, return 1 once it is done
+
+    char data[READ_SIZE];
+    const char *in = data;
+    ssize_t n, i;
+    size_t closed = parser.nb_slides;
+    int c, len;
+
+    if (parser.map != NULL) {
+        in = &(parser.map[parser.pos]);
+        n = MIN(MAP_CHUNK, parser.map_size - parser.pos);
+    } else {
+        n = read(parser.fd, data, sizeof(data));
+    }
+    pthread_mutex_lock(&parser.lock);
+    if (n < 0)
+        parser.error = ERR_FILE_CONNECTION;
+    for (i = 0; i < n && !parser.error; i++) {
+        c = in[i];
+        if (parser.need > 0) {
+            // UTF-8 compliance check
+            if (((char) c & (char) 0xc0) != (char) 0x80)
+                parser.error = ERR_UNICODE_OR_UTF8;
+            parser.need--;
+        } else if (c == '\n') {
+            parser.line_end = parser.pos + i + 1;
+            parse_line(0);
+            parser.line_start = parser.line_end;
+            continue;
+        } else if ((len = utf8_char_length(c)) == 0) {
+            // reported by sync_deck(), termbox being restored by the main
+            // thread
+            parser.error = ERR_UNICODE_OR_UTF8;
+        } else if ((parser.need = len - 1) > 0) {
+            // the slide needs decoding, see index_slide()
+            parser.buf[parser.nb_slides].ascii = 0;
+        }
+
+        // potentially resize chars, then store the byte
+        if (parser.ml + 2 > parser.chars_size) {
+            parser.chars_size <<= 1;
+            if ((parser.chars = mem_realloc(parser.chars, parser.chars_size,
+                MEM_PARSE)) == NULL) {
+                tb_shutdown();
+                exit(ERR_MALLOC);
+            }
+        }
+        parser.chars[parser.ml++] = (char) c;
+    }
+    if (n > 0 && parser.map != NULL)
+        release(parser.pos, parser.pos + n);
+    if (n > 0)
+        parser.pos += n;
+    if (n == 0 && !parser.error) {
+        // the last line is only used to close the last slide
+        parser.line_end = parser.pos;
+        if (parser.need > 0)
+            parser.error = ERR_UNICODE_OR_UTF8;
+        else
+            parse_line(1);
+        trace_span("load", parser.load_start, -1, -1);
+    }
+    if (n <= 0 || parser.error) {
+        close(parser.fd);
+        parser.fd = -1;
+        _free(parser.chars);
+        parser.chars = NULL;
+    }
+    if (parser.nb_slides != closed || parser.fd < 0)
+        write(parser.notify[1], "", 1);
+    pthread_mutex_unlock(&parser.lock);
+
+    return parser.fd < 0;
+}
+
+void *
+parse_run(void *arg)
+{
+    // read the rest of the deck, in the background
+
+    while (!parse_more())
+        ;
+
+    return arg;
+}
+
+void
+parse_start(void)
+{
+    // read the rest of the deck in a thread, see sync_deck()
+
+    if (pthread_create(&parser.thread, NULL, parse_run, NULL)) {
+        tb_shutdown();
+        exit(ERR_FILE_CONNECTION);
+    }
+    parser.started = 1;
+}
+
+void
+sync_deck(struct slide **buf)
+{
+    // catch up with the slides, outline and metadata read so far
+
+    char drain[64];
+
+    if (!loading && *buf != NULL)
+        return;
+    pthread_mutex_lock(&parser.lock);
+    if (parser.error) {
+        tb_shutdown();
+        exit(parser.error);
+    }
+    *buf = parser.buf;
+    nb_slides = MIN(parser.nb_slides, INT_MAX);
+    headings = parser.headings;
+    nb_headings = MIN(parser.nb_headings, INT_MAX);
+    strcpy(title, parser.title);
+    strcpy(author, parser.author);
+    if (loading && parser.fd < 0)
+        pthread_join(parser.thread, NULL);
+    loading = parser.fd >= 0;
+    pthread_mutex_unlock(&parser.lock);
+    while (read(parser.notify[0], drain, sizeof(drain)) > 0)
+        ;
+}
+
+void
+release(size_t from, size_t to)
+{
+    // let the pages of the mapped deck between from and to be reclaimed
+
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    from = (from + page - 1)/page*page;
+    to = to/page*page;
+    if (from < to)
+        madvise((char *) &(parser.map[from]), to - from, MADV_DONTNEED);
+}
+
+int
+kept_line(const char *chars, size_t ml, int *preformatted_mode)
+{
+    // tell if the line chars of ml bytes is part of its slide, as parse_line
+    // decides it
+
+    if (ml >= 3 && chars[0] == '`' && chars[1] == '`' && chars[2] == '`')
+        *preformatted_mode ^= 1;
+
+    return *preformatted_mode || (strncmp("%title:", chars, 7) &&
+        strncmp("%author:", chars, 8) && strncmp("%date:", chars, 6));
+}
+
+void
+lru_unlink(struct loaded *l)
+{
+    // remove loaded slide l from the LRU list
+
+    if (l->newer != NULL)
+        l->newer->older = l->older;
+    else
+        lru_newest = l->older;
+    if (l->older != NULL)
+        l->older->newer = l->newer;
+    else
+        lru_oldest = l->newer;
+    l->newer = l->older = NULL;
+}
+
+void
+evict(struct loaded *l)
+{
+    // free loaded slide l and its lines
+
+    struct loaded **p;
+    struct line *line;
+    const uint8_t *syntax = NULL;
+
+    while ((line = l->s.start) != NULL) {
+        // blocks start after fences, which are not highlighted
+        if (line->syntax != NULL && syntax == NULL)
+            unref_block(line->syntax);
+        syntax = line->syntax;
+        l->s.start = line->next;
+        _free(line->chars);
+        _free(line);
+    }
+    for (p = &(loaded[l->index % LOADED_BUCKETS]); *p != l; p = &((*p)->next))
+        ;
+    *p = l->next;
+    window_bytes -= l->bytes;
+    lru_unlink(l);
+
+    // layouts of it pointed to its lines
+    if (lay.index == l->index + 1)
+        lay.index = 0;
+    if (ahead.index == l->index + 1)
+        ahead.index = 0;
+    _free(l);
+}
+
+struct slide *
+load_slide(struct slide *buf, int index)
+{
+    // in window mode, load the lines of slide index from the mapped deck if
+    // needed, then evict the least recently used slides beyond window_cap;
+    // only those loaded take more than their entry in buf
+
+    struct loaded *l;
+    struct line *line, *last = NULL, *fence = NULL;
+    const struct lexer *lx = NULL;
+    const char *chars, *end, *nl;
+    size_t ml;
+    int preformatted_mode = 0;
+    int64_t start;
+
+    if (parser.map == NULL)
+        return &(buf[index]);
+    for (l = loaded[index % LOADED_BUCKETS]; l != NULL && l->index != index;
+        l = l->next)
+        ;
+    if (l != NULL) {
+        lru_unlink(l);
+    } else {
+        start = now_us();
+        l = _malloc(sizeof(struct loaded), MEM_PARSE);
+        l->s.start = NULL;
+        l->s.nb_parts = buf[index].nb_parts;
+        l->s.ascii = buf[index].ascii;
+        l->index = index;
+        l->bytes = sizeof(struct loaded);
+        l->newer = l->older = NULL;
+        l->next = loaded[index % LOADED_BUCKETS];
+        loaded[index % LOADED_BUCKETS] = l;
+
+        // its lines end before the line closing it, or the next slide
+        chars = &(parser.map[buf[index].offset]);
+        end = &(parser.map[buf[index + 1].offset]);
+        for (; (nl = memchr(chars, '\n', end - chars)) != NULL;
+            chars = nl + 1) {
+            ml = nl - chars;
+            if (!preformatted_mode && ml >= 3 && chars[0] == '-' &&
+                chars[1] == '-' && chars[2] == '-')
+                break;
+            if (!kept_line(chars, ml, &preformatted_mode))
+                continue;
+            line = _malloc(sizeof(struct line), MEM_PARSE);
+            line->chars = copy_chars(chars, ml);
+            line->syntax = NULL;
+            line->next = NULL;
+            if (last == NULL)
+                l->s.start = last = line;
+            else
+                last = last->next = line;
+            l->bytes += sizeof(struct line) + ml + 1;
+            if (ml >= 3 && chars[0] == '`' && chars[1] == '`' &&
+                chars[2] == '`')
+                handle_fence(line, preformatted_mode, &fence, &lx);
+        }
+        window_bytes += l->bytes;
+        release(buf[index].offset, buf[index + 1].offset);
+        trace_span("load", start, index + 1, -1);
+    }
+
+    // the slide is now the most recently used one
+    l->older = lru_newest;
+    if (lru_newest != NULL)
+        lru_newest->newer = l;
+    else
+        lru_oldest = l;
+    lru_newest = l;
+    while (window_bytes > window_cap && lru_oldest != l)
+        evict(lru_oldest);
+
+    return &(l->s);
+}
+
+int
+line_style(const char *chars, int preformatted_mode, int *accent, int *color)
+{
+    // colors of the first cell of line chars and of the others, return its
+    // heading level, 0 if it is not a heading
+
+    int lvl = 0;
+
+    if (preformatted_mode) {
+        *accent = *color = COLOR_DEFAULT;
+    } else if (chars[0] == '=' && chars[1] == '>') {
+        *accent = *color = COLOR_LINK;
+    } else if (chars[0] == '#') {
+        lvl = (chars[1] == '#') ? ((chars[2] == '#') ? 3 : 2) : 1;
+        *accent = *color = COLOR_HEADING | ((lvl == 1) ? TB_UNDERLINE : 0);
+    } else {
+        *accent = *color = COLOR_DEFAULT;
+        if (chars[0] == '*' && chars[1] == ' ') {
+            *accent = COLOR_LIST;
+        } else if (chars[0] == '>') {
+            *accent = COLOR_QUOTE;
+        }
+    }
+
+    return lvl;
+}
+
+int
+fit_chars(const struct layout_line *line, int kc, int end, int *j)
+{
+    // fit the characters of line from position kc to end in a row from
+    // column *j, return where those fitting end, *j being their end column
+
+    const uint8_t *widths = &(lay.widths[line->cp]);
+    int w;
+
+    if (lay.ascii) {
+        w = MIN(end - kc, dw - *j);
+        *j += w;
+        return kc + w;
+    }
+    for (; kc < end; kc++) {
+        if ((w = widths[kc]) == 0 && *j > 0)
+            continue;
+        w = MAX(w, 1);
+        if (*j + w > dw)
+            break;
+        *j += w;
+    }
+
+    return kc;
+}
+
+int
+wrap_row(const struct layout_line *line, int kc, int lvl, uint32_t *ch,
+    uint8_t *hl, int *hl_start, int *hl_end)
+{
+    // lay the row of line starting at position kc out into the dw cells of
+    // ch, flagging highlighted ones in hl and adding marks to lay.combining,
+    // return where the next row starts; only find that out if ch is NULL.
+    // The row ends before the first word not fitting, found by binary search
+    // on the columns of the words, or within a word wider than a row
+
+    const struct word *wd = &(lay.words[line->word]);
+    const uint32_t *cps = &(lay.cps[line->cp]);
+    const uint8_t *widths = &(lay.widths[line->cp]);
+    const int *at = &(lay.at[line->cp]);
+    int a, b, c, base, end, i, j = 0, jb = 0, next, w;
+    int marks = lay.nb_combining;
+
+    // first word ending after kc, leading spaces being skipped
+    for (a = 0, b = line->nb_words; a < b;) {
+        c = (a + b)/2;
+        if (wd[c].end <= kc)
+            a = c + 1;
+        else
+            b = c;
+    }
+    if (a == line->nb_words) {
+        kc = end = next = line->len;
+    } else {
+        kc = MAX(kc, wd[a].start);
+        end = next = fit_chars(line, kc, wd[a].end, &j);
+    }
+    if (a < line->nb_words && end == wd[a].end) {
+        // the words after it fitting, wd[b] being the last one
+        base = wd[a].e - j;
+        for (b = a, c = line->nb_words; b + 1 < c;) {
+            i = (b + c)/2;
+            if (wd[i].x - base < dw && wd[i].e - base <= dw)
+                b = i;
+            else
+                c = i;
+        }
+        end = wd[b].end;
+        if (b + 1 == line->nb_words) {
+            next = line->len;
+        } else {
+            // spaces before the next word are printed if they fit
+            next = wd[b + 1].start;
+            if (wd[b + 1].x - base < dw)
+                end = next;
+        }
+    }
+    if (ch == NULL)
+        return next;
+
+    j = 0;
+    if (lay.ascii) {
+        for (; kc < end; kc++, j++) {
+            hl[j] = highlighted(line->chars, kc, hl_start, hl_end);
+            ch[j] = (unsigned char) line->chars[kc];
+        }
+    }
+    for (; kc < end; kc++) {
+        if ((w = widths[kc]) == 0 && j > 0) {
+            // combine with the previous character
+            add_combining(jb, cps[kc]);
+            continue;
+        }
+        w = MAX(w, 1);
+        hl[j] = highlighted(line->chars, at[kc], hl_start, hl_end);
+        ch[j] = cps[kc];
+        for (i = 1; i < w; i++) {
+            hl[j + i] = hl[j];
+            ch[j + i] = 0;
+        }
+        jb = j;
+        j += w;
+    }
+    fill_row(ch, hl, j, lvl, marks);
+
+    return next;
+}
+
+void
+fill_row(uint32_t *ch, uint8_t *hl, int j, int lvl, int marks)
+{
+    // complete the row of j cells laid out into ch, centering it for
+    // headings along with its marks from lay.combining[marks]
+
+    int i, w_offset;
+
+    // center
+    if (((lvl == 1) || (lvl == 2)) && j < dw) {
+        j += (w_offset = (dw - j)/2);
+        for (i = j - 1; i >= w_offset; i--) {
+            ch[i] = ch[i - w_offset];
+            hl[i] = hl[i - w_offset];
+        }
+        while (i >= 0) {
+            hl[i] = 0;
+            ch[i--] = ' ';
+        }
+        for (i = marks; i < lay.nb_combining; i++)
+            lay.combining[i].cell += w_offset;
+    }
+
+    // fill with ' '
+    while (j < dw) {
+        hl[j] = 0;
+        ch[j++] = ' ';
+    }
+}
+
+void
+add_combining(int cell, uint32_t c)
+{
+    // draw mark c over cell of the row being laid out
+
+    struct combining *p;
+
+    if (lay.nb_combining == lay.combining_size) {
+        lay.combining_size = MAX(2*lay.combining_size, 64);
+        if ((p = mem_realloc(lay.combining, sizeof(struct combining) *
+            lay.combining_size, MEM_LAYOUT)) == NULL) {
+            tb_shutdown();
+            exit(ERR_MALLOC);
+        }
+        lay.combining = p;
+    }
+    lay.combining[lay.nb_combining].cell = cell;
+    lay.combining[lay.nb_combining++].ch = c;
+}
+
+int
+segment_line(const struct layout_line *line, int kc, struct word *wd)
+{
+    // split line from position kc into words, with the columns they would
+    // span on a single row, return their number
+
+    const uint32_t *cps = &(lay.cps[line->cp]);
+    const uint8_t *widths = &(lay.widths[line->cp]);
+    const char *chars = line->chars;
+    int col = 0, n = 0, w;
+
+    while (kc < line->len) {
+        if ((lay.ascii) ? chars[kc] == ' ' : cps[kc] == ' ') {
+            // leading spaces are skipped by every row
+            col += (n > 0);
+            kc++;
+            continue;
+        }
+        wd[n].start = kc;
+        wd[n].x = col;
+        if (lay.ascii) {
+            kc += strcspn(&(chars[kc]), " ");
+            col += kc - wd[n].start;
+        }
+        for (; !lay.ascii && kc < line->len && cps[kc] != ' '; kc++) {
+            w = widths[kc];
+            col += (w == 0 && col > 0) ? 0 : MAX(w, 1);
+        }
+        wd[n].end = kc;
+        wd[n++].e = col;
+    }
+
+    return n;
+}
+
+void
+segment_slide(const struct slide s, int index)
+{
+    // list the lines of slide s into lay, decoded, split into words and with
+    // checkpoints in preformatted ones: what does not depend on the width
+
+    struct line *l;
+    struct layout_line *line;
+    int preformatted_mode = 0;
+    int accent, color, lvl, kc, n, nb_cps, nb_marks, parts, w;
+    size_t bytes, nb_words;
+    int64_t start = now_us();
+
+    for (n = 0, bytes = 0, l = s.start; l != NULL; l = l->next, n++)
+        bytes += strlen(l->chars);
+    // the arrays below are kept for the next slides, only grown for bigger
+    // ones, so that going back to a slide does not allocate
+    if ((size_t) n + 1 > lay.lines_size) {
+        lay.lines_size = MAX((size_t) n + 1, 2*lay.lines_size);
+        _free(lay.lines);
+        lay.lines = _malloc(sizeof(struct layout_line) * lay.lines_size,
+            MEM_LAYOUT);
+    }
+    if ((size_t) s.nb_parts + 1 > lay.ends_size) {
+        lay.ends_size = MAX((size_t) s.nb_parts + 1, 2*lay.ends_size);
+        _free(lay.ends);
+        lay.ends = _malloc(sizeof(int) * lay.ends_size, MEM_LAYOUT);
+    }
+    if (bytes/PRE_CHECKPOINT + n + 1 > lay.marks_size) {
+        lay.marks_size = MAX(bytes/PRE_CHECKPOINT + n + 1, 2*lay.marks_size);
+        _free(lay.marks);
+        lay.marks = _malloc(2*sizeof(int) * lay.marks_size, MEM_LAYOUT);
+    }
+    lay.ascii = s.ascii;
+    if (!lay.ascii && bytes + n > lay.cps_size) {
+        // at most a code point per byte, then 0 after each line
+        lay.cps_size = MAX(bytes + n, 2*lay.cps_size);
+        _free(lay.cps);
+        _free(lay.at);
+        _free(lay.widths);
+        lay.cps = _malloc(sizeof(uint32_t) * lay.cps_size, MEM_LAYOUT);
+        lay.at = _malloc(sizeof(int) * lay.cps_size, MEM_LAYOUT);
+        lay.widths = _malloc(lay.cps_size, MEM_LAYOUT);
+    }
+    if (bytes/2 + n > lay.words_size) {
+        // words are a position long at least, spaces between them too
+        lay.words_size = MAX(bytes/2 + n, 2*lay.words_size);
+        _free(lay.words);
+        lay.words = _malloc(sizeof(struct word) * lay.words_size,
+            MEM_LAYOUT);
+    }
+    lay.cols = parts = nb_cps = nb_marks = 0;
+    nb_words = 0;
+    for (n = 0, l = s.start; l != NULL; l = l->next, n++) {
+        line = &(lay.lines[n]);
+        line->chars = l->chars;
+        line->syntax = l->syntax;
+        line->cp = nb_cps;
+        line->len = strlen(l->chars);
+        line->word = nb_words;
+        line->nb_words = 0;
+        if (!lay.ascii) {
+            line->len = decode_utf8(l->chars, line->len, &(lay.cps[nb_cps]),
+                &(lay.at[nb_cps]), &(lay.widths[nb_cps]));
+            lay.cps[nb_cps + line->len] = 0;
+            lay.at[nb_cps + line->len] = strlen(l->chars);
+            nb_cps += line->len + 1;
+        }
+        if (l->chars[0] == '`' && l->chars[1] == '`' && l->chars[2] == '`') {
+            preformatted_mode ^= 1;
+        } else if (preformatted_mode) {
+            // a single row, with a checkpoint every PRE_CHECKPOINT columns;
+            // there are fewer columns than bytes
+            line->marks = nb_marks;
+            line->cols = lay.ascii ? line->len : 0;
+            for (kc = 0; !lay.ascii && kc < line->len; kc++) {
+                w = lay.widths[line->cp + kc];
+                if (w == 0 && line->cols > 0)
+                    continue;
+                w = MAX(w, 1);
+                if (line->cols + w > (nb_marks - line->marks) *
+                    PRE_CHECKPOINT) {
+                    lay.marks[2*nb_marks] = kc;
+                    lay.marks[2*nb_marks++ + 1] = line->cols;
+                }
+                line->cols += w;
+            }
+            lay.cols = MAX(lay.cols, line->cols);
+        } else if (l->chars[0] == '^') {
+            parts++;
+        } else {
+            // hide '#' for headings
+            lvl = line_style(l->chars, 0, &accent, &color);
+            for (kc = 0; lvl && l->chars[kc] == '#'; kc++)
+                ;
+            line->nb_words = segment_line(line, kc, &(lay.words[nb_words]));
+            nb_words += line->nb_words;
+        }
+        line->preformatted = preformatted_mode;
+    }
+    lay.lines[n].chars = NULL;
+    lay.nb_lines = n;
+    lay.nb_parts = MIN(parts + 1, s.nb_parts);
+    lay.index = index;
+    lay.dw = 0;
+    trace_span("segment", start, index, -1);
+}
+
+void
+index_slide(void)
+{
+    // wrap the lines of the segmented slide at the current width: the rows
+    // they start at, and the rows displayed up to each part
+
+    struct layout_line *line;
+    int accent, color, lvl, kc, n, parts, row;
+    int64_t start = now_us();
+
+    lay.ends[0] = 0;
+    for (n = parts = row = 0; n < lay.nb_lines; n++) {
+        line = &(lay.lines[n]);
+        line->row = row;
+        if (line->chars[0] == '`' && line->chars[1] == '`' &&
+            line->chars[2] == '`') {
+            continue;
+        } else if (line->preformatted) {
+            row++;
+        } else if (line->chars[0] == '^') {
+            if (++parts < lay.nb_parts)
+                lay.ends[parts] = row;
+        } else {
+            lvl = line_style(line->chars, 0, &accent, &color);
+            kc = 0;
+            while (lvl && line->chars[kc] == '#')
+                kc++;
+            do {
+                kc = wrap_row(line, kc, lvl, NULL, NULL, NULL, NULL);
+                row++;
+            } while (kc < line->len);
+        }
+    }
+    lay.lines[n].row = row;
+    lay.ends[lay.nb_parts] = row;
+    lay.dw = dw;
+    lay.height = 0;
+    lay.shown = 0;
+    trace_span("wrap", start, lay.index, dw);
+}
+
+void
+clip_row(const struct layout_line *line, int col, uint32_t *ch,
+    uintattr_t *fg, uint8_t *hl)
+{
+    // lay the dw columns of preformatted line from column col out into ch,
+    // with the colors of its syntax in fg, flagging highlighted ones in hl
+    // and adding marks to lay.combining, only going through its code points
+    // from the checkpoint before col; wide characters cut by an edge are
+    // left blank
+
+    const char *chars = line->chars;
+    const uint32_t *cps;
+    const uint8_t *widths;
+    const int *at;
+    int hl_start = 0, hl_end = 0;
+    int i, j = 0, jb = -1, kc, m, w;
+
+    if (lay.ascii) {
+        // a byte per column
+        for (i = MAX(col - query_len + 1, 0); i < col; i++)
+            highlighted(chars, i, &hl_start, &hl_end);
+        for (; j < dw && col + j < line->cols; j++) {
+            hl[j] = highlighted(chars, col + j, &hl_start, &hl_end);
+            ch[j] = (unsigned char) chars[col + j];
+            fg[j] = (line->syntax == NULL) ? COLOR_DEFAULT :
+                syntax_colors[line->syntax[col + j]];
+        }
+    } else if (col < line->cols) {
+        cps = &(lay.cps[line->cp]);
+        widths = &(lay.widths[line->cp]);
+        at = &(lay.at[line->cp]);
+        m = line->marks + col/PRE_CHECKPOINT;
+        kc = lay.marks[2*m];
+        j = lay.marks[2*m + 1] - col;
+
+        // matches may start before the checkpoint
+        for (i = MAX(at[kc] - query_len + 1, 0); i < at[kc]; i++)
+            highlighted(chars, i, &hl_start, &hl_end);
+        for (; j < dw && cps[kc]; kc++) {
+            highlighted(chars, at[kc], &hl_start, &hl_end);
+            if ((w = widths[kc]) == 0 && j + col > 0) {
+                if (jb >= 0)
+                    add_combining(jb, cps[kc]);
+                continue;
+            }
+            w = MAX(w, 1);
+            jb = -1;
+            if (j < 0 || j + w > dw) {
+                // left of the first column, or cut by an edge
+                for (i = MAX(j, 0); i < MIN(j + w, dw); i++) {
+                    hl[i] = 0;
+                    fg[i] = COLOR_DEFAULT;
+                    ch[i] = ' ';
+                }
+                j += w;
+                continue;
+            }
+            hl[j] = hl_start <= at[kc] && at[kc] < hl_end;
+            ch[j] = cps[kc];
+            fg[j] = (line->syntax == NULL) ? COLOR_DEFAULT :
+                syntax_colors[line->syntax[at[kc]]];
+            for (i = 1; i < w; i++) {
+                hl[j + i] = hl[j];
+                ch[j + i] = 0;
+                fg[j + i] = fg[j];
+            }
+            jb = j;
+            j += w;
+        }
+        j = MIN(MAX(j, 0), dw);
+    }
+
+    // fill with ' '
+    while (j < dw) {
+        hl[j] = 0;
+        fg[j] = COLOR_DEFAULT;
+        ch[j++] = ' ';
+    }
+}
+
+void
+layout_rows(int first, int hscroll)
+{
+    // lay the rows of the indexed slide out into lay from row first, with a
+    // margin of rows before and after a screen, and preformatted lines from
+    // column hscroll
+
+    const struct layout_line *line;
+    uint8_t *hl = lay.hl;
+    int accent, color, lvl;
+    int a, b, c, i, j, k, kc, marks, row, rows;
+    int hl_start, hl_end;
+    int64_t start = now_us();
+
+    first = MAX(first - SCROLL_MARGIN, 0);
+    lay.nb_combining = 0;
+    rows = MIN(height - 2 + 2*SCROLL_MARGIN, lay.lines[lay.nb_lines].row -
+        first);
+
+    // last line starting at or before row first
+    for (a = 0, b = lay.nb_lines; a + 1 < b;) {
+        c = (a + b)/2;
+        if (lay.lines[c].row <= first)
+            a = c;
+        else
+            b = c;
+    }
+
+    // rows of the lines before first are wrapped again, but not kept
+    for (k = 0, line = &(lay.lines[a]); k < rows; line++) {
+        lvl = line_style(line->chars, line->preformatted, &accent, &color);
+        kc = hl_start = hl_end = 0;
+        while (lvl && line->chars[kc] == '#')
+            kc++;
+        for (row = line->row; row < line[1].row && k < rows; row++) {
+            marks = lay.nb_combining;
+            if (line->preformatted)
+                clip_row(line, hscroll, &(lay.ch[k*dw]), &(lay.fg[k*dw]), hl);
+            else
+                kc = wrap_row(line, kc, lvl, &(lay.ch[k*dw]), hl, &hl_start,
+                    &hl_end);
+            if (row < first) {
+                lay.nb_combining = marks;
+                continue;
+            }
+            for (i = marks; i < lay.nb_combining; i++)
+                lay.combining[i].cell += k*dw;
+            for (j = 0; j < dw; j++) {
+                if (!line->preformatted)
+                    lay.fg[k*dw + j] = (j == 0 && row == line->row) ? accent :
+                        color;
+                lay.fg[k*dw + j] |= hl[j] ? TB_REVERSE : 0;
+                lay.bg[k*dw + j] = COLOR_BG;
+            }
+            k++;
+        }
+    }
+    lay.first = first;
+    lay.nb_rows = rows;
+    lay.height = height;
+    lay.hscroll = hscroll;
+    strcpy(lay.query, query);
+    lay.shown = 0;
+
+    trace_span("layout", start, lay.index, dw);
+}
+
+void
+combine_rows(int a, int b, int y)
+{
+    // draw the marks of laid out rows a to b, just blitted from screen row
+    // y, as grapheme clusters with their cells
+
+    uint32_t cluster[MAX_CLUSTER];
+    int cell, i, n;
+
+    for (i = 0; i < lay.nb_combining && lay.combining[i].cell < a*dw; i++)
+        ;
+    while (i < lay.nb_combining && (cell = lay.combining[i].cell) < b*dw) {
+        cluster[0] = lay.ch[cell];
+        for (n = 1; i < lay.nb_combining && lay.combining[i].cell == cell;
+            i++)
+            if (n < MAX_CLUSTER)
+                cluster[n++] = lay.combining[i].ch;
+        tb_set_cell_ex(offset + cell % dw, y + cell/dw - a, cluster, n,
+            lay.fg[cell], lay.bg[cell]);
+    }
+}
+
+void
+display_slide(const struct slide s, int index, int nb_parts, int *scroll,
+    int *hscroll)
+{
+    // display slide s on the screen, *scroll rows below where its last part
+    // is best seen and its preformatted lines *hscroll columns right, laying
+    // it out if needed, and only drawing revealed or hidden lines if other
+    // parts are on screen at the same place
+
+    char ruler[32];
+    int h_offset, lines, shown, base, top, a, b, i;
+    int rows = height - 2;
+
+    if (lay.lines == NULL || lay.index != index)
+        segment_slide(s, index);
+    if (lay.dw != dw)
+        index_slide();
+    lines = lay.ends[MIN(nb_parts, lay.nb_parts)];
+
+    // the start of the last part, or as much of it as fits, then scrolled
+    // within the revealed rows
+    base = MAX(MIN(lay.ends[MIN(nb_parts, lay.nb_parts) - 1], lines - rows),
+        0);
+    top = MAP(base + *scroll, 0, MAX(lines - rows, 0));
+    *scroll = top - base;
+    *hscroll = MAP(*hscroll, 0, MAX(lay.cols - dw, 0));
+    h_offset = 1 + MAX((rows - lay.lines[lay.nb_lines].row) >> 1, 0);
+    if (lay.height != height || strcmp(lay.query, query) ||
+        lay.hscroll != *hscroll || top < lay.first ||
+        MIN(top + rows, lay.lines[lay.nb_lines].row) >
+        lay.first + lay.nb_rows)
+        layout_rows(top, *hscroll);
+
+    if (lay.shown == 0 || lay.top != top) {
+        // content printing
+        tb_clear();
+        if ((b = MIN(lines, top + rows)) > top) {
+            tb_blit(offset, h_offset, dw, b - top,
+                &(lay.ch[(top - lay.first)*dw]),
+                &(lay.fg[(top - lay.first)*dw]),
+                &(lay.bg[(top - lay.first)*dw]));
+            combine_rows(top - lay.first, b - lay.first, h_offset);
+        }
+
+        // metadata printing
+        format_ruler(ruler, index);
+        display_metadata(ruler);
+    } else {
+        shown = lay.ends[MIN(lay.shown, lay.nb_parts)];
+        if ((a = MAX(shown, top)) < (b = MIN(lines, top + rows))) {
+            tb_blit(offset, h_offset + a - top, dw, b - a,
+                &(lay.ch[(a - lay.first)*dw]),
+                &(lay.fg[(a - lay.first)*dw]),
+                &(lay.bg[(a - lay.first)*dw]));
+            combine_rows(a - lay.first, b - lay.first, h_offset + a - top);
+        }
+        if ((a = MAX(lines, top)) < (b = MIN(shown, top + rows))) {
+            for (i = 0; i < dw; i++) {
+                row_ch[i] = ' ';
+                row_fg[i] = COLOR_DEFAULT;
+                row_bg[i] = COLOR_BG;
+            }
+            for (i = a; i < b; i++)
+                tb_blit(offset, h_offset + i - top, dw, 1, row_ch, row_fg,
+                    row_bg);
+        }
+    }
+    lay.shown = nb_parts;
+    lay.top = top;
+}
+
+uint32_t
+trigram(const char *chars)
+{
+    // pack the three bytes starting at chars, ASCII lowercased
+
+    return (uint32_t) tolower((unsigned char) chars[0]) << 16 |
+        (uint32_t) tolower((unsigned char) chars[1]) << 8 |
+        (uint32_t) tolower((unsigned char) chars[2]);
+}
+
+int
+compare_pairs(const void *a, const void *b)
+{
+    // order (trigram, line) pairs packed in 64 bits
+
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+void
+build_index(const struct slide *buf)
+{
+    // index the trigrams of the lines of the slides read since the last
+    // build, merged with those of the previous ones: searching while the
+    // deck loads does not index it again
+
+    const struct line *l;
+    const char *chars;
+    uint64_t *pairs;
+    uint32_t key, *keys;
+    size_t *starts, *postings;
+    size_t nb_pairs, first, len, a, i, k, n;
+    int preformatted_mode, part, s;
+    int64_t start = now_us();
+
+    // lines, with the slide and part revealing them, but for the fences
+    // and part marks display_slide() hides
+    for (n = idx.nb_lines, s = idx.nb_slides; s < nb_slides; s++)
+        for (l = buf[s].start; l != NULL; l = l->next)
+            n++;
+    // pairs keep line numbers in 40 bits, below trigrams
+    if ((uint64_t) n >> 40) {
+        tb_shutdown();
+        exit(ERR_MALLOC);
+    }
+    if (n > SIZE_MAX / sizeof(struct search_line) || (idx.lines =
+        mem_realloc(idx.lines, sizeof(struct search_line) * MAX(n, 1),
+        MEM_SEARCH)) == NULL) {
+        tb_shutdown();
+        exit(ERR_MALLOC);
+    }
+    first = idx.nb_lines;
+    nb_pairs = 0;
+    for (s = idx.nb_slides; s < nb_slides; s++) {
+        preformatted_mode = 0;
+        part = 1;
+        for (l = buf[s].start; l != NULL; l = l->next) {
+            if (l->chars[0] == '`' && l->chars[1] == '`' &&
+                l->chars[2] == '`') {
+                preformatted_mode ^= 1;
+                continue;
+            } else if (!preformatted_mode && l->chars[0] == '^') {
+                part++;
+                continue;
+            }
+            idx.lines[idx.nb_lines].chars = l->chars;
+            idx.lines[idx.nb_lines].slide = s;
+            idx.lines[idx.nb_lines].part = part;
+            idx.nb_lines++;
+            if ((len = strlen(l->chars)) > 2)
+                nb_pairs += len - 2;
+        }
+    }
+    idx.nb_slides = nb_slides;
+
+    // sorted (trigram, line) pairs of the new lines, each one once
+    pairs = _mallocn(nb_pairs, sizeof(uint64_t), MEM_SEARCH);
+    for (n = 0, i = first; i < idx.nb_lines; i++) {
+        chars = idx.lines[i].chars;
+        for (k = 0; chars[k] && chars[k + 1] && chars[k + 2]; k++)
+            pairs[n++] = (uint64_t) trigram(&(chars[k])) << 40 | i;
+    }
+    qsort(pairs, nb_pairs, sizeof(uint64_t), compare_pairs);
+    for (n = k = i = 0; i < nb_pairs; i++) {
+        if (i > 0 && pairs[i] == pairs[i - 1])
+            continue;
+        if (n == 0 || pairs[i] >> 40 != pairs[n - 1] >> 40)
+            k++;
+        pairs[n++] = pairs[i];
+    }
+    nb_pairs = n;
+
+    // merged with the keys and postings so far: new lines come after the
+    // previous ones in the postings of each key
+    len = (idx.nb_keys > 0) ? idx.starts[idx.nb_keys] : 0;
+    keys = _mallocn(idx.nb_keys + k, sizeof(uint32_t), MEM_SEARCH);
+    starts = _mallocn(idx.nb_keys + k + 1, sizeof(size_t), MEM_SEARCH);
+    postings = _mallocn(len + nb_pairs, sizeof(size_t), MEM_SEARCH);
+    for (n = k = a = i = 0; a < idx.nb_keys || i < nb_pairs; k++) {
+        key = (a < idx.nb_keys) ? idx.keys[a] : UINT32_MAX;
+        if (i < nb_pairs)
+            key = MIN(key, (uint32_t) (pairs[i] >> 40));
+        keys[k] = key;
+        starts[k] = n;
+        if (a < idx.nb_keys && idx.keys[a] == key) {
+            len = idx.starts[a + 1] - idx.starts[a];
+            memcpy(&(postings[n]), &(idx.postings[idx.starts[a]]),
+                sizeof(size_t) * len);
+            n += len;
+            a++;
+        }
+        for (; i < nb_pairs && pairs[i] >> 40 == key; i++)
+            postings[n++] = pairs[i] & (((uint64_t) 1 << 40) - 1);
+    }
+    starts[k] = n;
+    _free(idx.keys);
+    _free(idx.starts);
+    _free(idx.postings);
+    idx.keys = keys;
+    idx.starts = starts;
+    idx.postings = postings;
+    idx.nb_keys = k;
+    _free(pairs);
+    trace_span("index", start, -1, -1);
+}
+
+int
+contains(const char *chars, size_t len)
+{
+    // tell if the len bytes of chars contain the query, ignoring ASCII case
+
+    size_t k;
+
+    for (k = 0; k + query_len <= len; k++)
+        if (!strncasecmp(&(chars[k]), query, query_len))
+            return 1;
+
+    return 0;
+}
+
+void
+search(const struct slide *buf)
+{
+    // list the lines matching the query, building the index if needed
+
+    uint32_t key;
+    size_t a, b, c, i, n;
+    int k;
+    int64_t start;
+
+    // window mode: the deck is scanned by next_hit() instead
+    if (parser.map != NULL)
+        return;
+    if (idx.nb_slides < nb_slides)
+        build_index(buf);
+    start = now_us();
+    _free(hits);
+    hits = NULL;
+    nb_hits = 0;
+    if (query_len == 0)
+        return;
+
+    if (query_len < 3) {
+        // too short for trigrams: scan every line
+        hits = _mallocn(idx.nb_lines, sizeof(size_t), MEM_SEARCH);
+        for (i = 0; i < idx.nb_lines; i++)
+            if (contains(idx.lines[i].chars, strlen(idx.lines[i].chars)))
+                hits[nb_hits++] = i;
+    } else {
+        // intersect the postings of every trigram of the query
+        for (k = 0; k + 2 < query_len; k++) {
+            key = trigram(&(query[k]));
+            for (a = 0, b = idx.nb_keys; a < b;) {
+                c = (a + b)/2;
+                if (idx.keys[c] < key)
+                    a = c + 1;
+                else
+                    b = c;
+            }
+            if (a == idx.nb_keys || idx.keys[a] != key) {
+                nb_hits = 0;
+                break;
+            }
+            if (hits == NULL) {
+                nb_hits = idx.starts[a + 1] - idx.starts[a];
+                hits = _mallocn(nb_hits, sizeof(size_t), MEM_SEARCH);
+                memcpy(hits, &(idx.postings[idx.starts[a]]),
+                    sizeof(size_t) * nb_hits);
+                continue;
+            }
+            for (n = i = 0, c = idx.starts[a]; i < nb_hits; i++) {
+                while (c < idx.starts[a + 1] && idx.postings[c] < hits[i])
+                    c++;
+                if (c < idx.starts[a + 1] && idx.postings[c] == hits[i])
+                    hits[n++] = hits[i];
+            }
+            nb_hits = n;
+        }
+
+        // trigrams may match in different places: check candidates
+        for (n = i = 0; i < nb_hits; i++)
+            if (contains(idx.lines[hits[i]].chars,
+                strlen(idx.lines[hits[i]].chars)))
+                hits[n++] = hits[i];
+        nb_hits = n;
+    }
+    trace_span("search", start, -1, -1);
+}
+
+void
+next_hit(int dir, int *index, int *parts)
+{
+    // move to the next (dir > 0) or previous (dir < 0) hit, or to the first
+    // hit from the current slide (dir == 0), wrapping around the deck
+
+    const struct search_line *h = NULL;
+    size_t i;
+
+    if (parser.map != NULL) {
+        window_hit(dir, index, parts);
+        return;
+    }
+    if (nb_hits == 0)
+        return;
+    if (dir >= 0) {
+        for (i = 0; i < nb_hits && h == NULL; i++) {
+            h = &(idx.lines[hits[i]]);
+            if (h->slide < *index ||
+                (dir && h->slide == *index && h->part <= *parts))
+                h = NULL;
+        }
+        if (h == NULL)
+            h = &(idx.lines[hits[0]]);
+    } else {
+        for (i = nb_hits; i > 0 && h == NULL; i--) {
+            h = &(idx.lines[hits[i - 1]]);
+            if (h->slide >= *index)
+                h = NULL;
+        }
+        if (h == NULL)
+            h = &(idx.lines[hits[nb_hits - 1]]);
+    }
+    *parts = (h->slide == *index) ? MAX(*parts, h->part) : h->part;
+    *index = h->slide;
+}
+
+int
+slide_hit(int index, int min_part, int last)
+{
+    // scan slide index in the mapped deck for lines matching the query,
+    // return the part revealing the first (or last) one beyond min_part, 0 if
+    // none
+
+    const struct slide *s = &(parser.buf[index]);
+    const char *chars = &(parser.map[s->offset]);
+    const char *end = &(parser.map[s[1].offset]), *nl;
+    size_t ml;
+    int preformatted_mode = 0;
+    int part = 1, hit = 0;
+
+    for (; (last || !hit) && (nl = memchr(chars, '\n', end - chars)) != NULL;
+        chars = nl + 1) {
+        ml = nl - chars;
+        if (!preformatted_mode && ml >= 3 && chars[0] == '-' &&
+            chars[1] == '-' && chars[2] == '-')
+            break;
+        // fences and part marks are not searched, as in build_index()
+        if (!kept_line(chars, ml, &preformatted_mode) || (ml >= 3 &&
+            chars[0] == '`' && chars[1] == '`' && chars[2] == '`'))
+            continue;
+        if (!preformatted_mode && ml >= 1 && chars[0] == '^') {
+            part++;
+            continue;
+        }
+        if (part > min_part && contains(chars, strnlen(chars, ml)))
+            hit = part;
+    }
+    release(s->offset, s[1].offset);
+
+    return hit;
+}
+
+void
+window_hit(int dir, int *index, int *parts)
+{
+    // next_hit() for window mode, where no index is built: scan the slides
+    // in the order next_hit() would consider their hits
+
+    int64_t i, start = now_us();
+    int s, part = 0;
+
+    if (query_len == 0)
+        return;
+    s = *index - (dir < 0);
+    for (i = 0; i <= nb_slides; i++, s += (dir < 0) ? -1 : 1) {
+        s = (s < 0) ? nb_slides - 1 : ((s == nb_slides) ? 0 : s);
+        part = slide_hit(s, (i == 0 && dir > 0) ? *parts : 0, dir < 0);
+        if (part)
+            break;
+    }
+    trace_span("search", start, -1, -1);
+    if (part == 0)
+        return;
+    *parts = (s == *index) ? MAX(*parts, part) : part;
+    *index = s;
+}
+
+int
+highlighted(const char *chars, int kc, int *hl_start, int *hl_end)
+{
+    // tell if byte kc of chars is part of a match of the query
+
+    if (query_len == 0)
+        return 0;
+    if ((kc < *hl_start || kc >= *hl_end) &&
+        !strncasecmp(&(chars[kc]), query, query_len)) {
+        *hl_start = kc;
+        *hl_end = kc + query_len;
+    }
+
+    return *hl_start <= kc && kc < *hl_end;
+}
+
+int
+text_width(const char *chars)
+{
+    // compute the columns UTF-8 string chars takes in the metadata rows
+
+    int k, len, w = 0;
+
+    for (k = 0; chars[k]; k += len) {
+        len = utf8_char_length(chars[k]);
+        w += char_width(unicode(chars, k, len));
+    }
+
+    return w;
+}
+
+int
+text_row(int x, const char *chars, uintattr_t fg)
+{
+    // write UTF-8 string chars into the metadata row from column x, without
+    // its marks, return the next column
+
+    uint32_t c;
+    int i, k, len, w;
+
+    for (k = 0; chars[k] && x < width; k += len) {
+        len = utf8_char_length(chars[k]);
+        c = unicode(chars, k, len);
+        if ((w = char_width(c)) == 0)
+            continue;
+        if (x + w > width)
+            break;
+        for (i = MAX(-x, 0); i < w; i++) {
+            row_ch[x + i] = (i == 0) ? c : (x >= 0) ? 0 : ' ';
+            row_fg[x + i] = fg;
+        }
+        x += w;
+    }
+
+    return x;
+}
+
+void
+display_metadata(const char *ruler)
+{
+    // display title, author and ruler around the content, a row at a time
+
+    int i;
+
+    for (i = 0; i < width; i++) {
+        row_ch[i] = ' ';
+        row_fg[i] = COLOR_DEFAULT;
+        row_bg[i] = COLOR_BG;
+    }
+    text_row((width - text_width(title))/2, title, COLOR_METADATA);
+    tb_blit(0, 0, width, 1, row_ch, row_fg, row_bg);
+
+    for (i = 0; i < width; i++) {
+        row_ch[i] = ' ';
+        row_fg[i] = COLOR_DEFAULT;
+    }
+    text_row(0, author, COLOR_METADATA);
+    text_row(width - (int) strlen(ruler), ruler, COLOR_METADATA);
+    tb_blit(0, height - 1, width, 1, row_ch, row_fg, row_bg);
+}
+
+void
+display_prompt(void)
+{
+    // display the search query being typed on the bottom row
+
+    int i;
+
+    lay.shown = 0;
+    for (i = 0; i < width; i++)
+        tb_set_cell(i, height - 1, ' ', COLOR_METADATA, COLOR_BG);
+    tb_printf(0, height - 1, COLOR_METADATA, COLOR_BG, "/%s", query);
+}
+
+void
+display_outline(int selected)
+{
+    // display the headings of the deck, scrolled around the selected one
+
+    const struct heading *hd;
+    char number[16], ruler[32];
+    uint32_t c;
+    int rows, top, color, i, j, jb, k, len, w, cw;
+
+    lay.shown = 0;
+    tb_clear();
+    rows = height - 2;
+    top = MAP(selected - rows/2, 0, MAX(nb_headings - rows, 0));
+    for (i = 0; i < rows && top + i < nb_headings; i++) {
+        hd = &headings[top + i];
+        color = COLOR_HEADING | ((top + i == selected) ? TB_REVERSE : 0);
+        sprintf(number, "%d", hd->slide + 1);
+        w = dw - strlen(number) - 1;
+
+        // indented heading text, truncated before the slide number
+        for (j = 0; j < w; j++)
+            tb_set_cell(offset + j, 1 + i, ' ', color, COLOR_BG);
+        for (j = jb = 2*(hd->lvl - 1), k = 0; hd->chars[k] &&
+            hd->chars[k] != '\n'; k += len) {
+            len = utf8_char_length(hd->chars[k]);
+            c = unicode(hd->chars, k, len);
+            if ((cw = char_width(c)) == 0 && j > jb) {
+                tb_extend_cell(offset + jb, 1 + i, c);
+                continue;
+            }
+            if (j + (cw = MAX(cw, 1)) > w)
+                break;
+            tb_set_cell(offset + j, 1 + i, c, color, COLOR_BG);
+            if (cw > 1)
+                tb_set_cell(offset + j + 1, 1 + i, 0, color, COLOR_BG);
+            jb = j;
+            j += cw;
+        }
+        tb_printf(offset + dw - strlen(number), 1 + i, COLOR_METADATA,
+            COLOR_BG, "%s", number);
+    }
+
+    sprintf(ruler, "%d/%d", nb_headings ? selected + 1 : 0, nb_headings);
+    display_metadata(ruler);
+}
+
+void
+display_hud(int index)
+{
+    // display timings of the last frame and their history next to the ruler
+
+    static const uint32_t bars[8] = {0x2581, 0x2582, 0x2583, 0x2584, 0x2585,
+        0x2586, 0x2587, 0x2588};
+    const struct frame_stats *f;
+    char ruler[32], text[64];
+    int64_t t, max;
+    int i, n, x, len, room;
+
+    lay.shown = 0;
+    if (hud_frames == 0)
+        return;
+    f = &hud[(hud_frames - 1) % HUD_HISTORY];
+    n = MIN(hud_frames, HUD_HISTORY);
+
+    // scale the histogram on the slowest frame of the history
+    for (max = 1, i = 0; i < n; i++)
+        max = MAX(max, hud[i].layout_us + hud[i].present_us);
+
+    format_ruler(ruler, index);
+    snprintf(text, sizeof(text), "L%lldus P%lldus %zuB %dc ",
+        (long long) f->layout_us, (long long) f->present_us, f->bytes,
+        f->cells);
+
+    // between the author and the ruler: the oldest frames of the history,
+    // then the end of the timings are left out if they do not fit
+    room = width - (int) strlen(ruler) - 1 - (text_width(author) + 1);
+    if (room <= 0)
+        return;
+    len = MIN((int) strlen(text), room);
+    n = MIN(n, room - len);
+    x = width - (int) strlen(ruler) - 1 - n - len;
+    tb_printf(x, height - 1, COLOR_METADATA, COLOR_BG, "%.*s", len, text);
+    x += len;
+    for (i = hud_frames - n; i < hud_frames; i++) {
+        t = hud[i % HUD_HISTORY].layout_us + hud[i % HUD_HISTORY].present_us;
+        tb_set_cell(x++, height - 1, bars[(7*t)/max], COLOR_METADATA,
+            COLOR_BG);
+    }
+}
+
+void
+step(const struct slide *buf, int di, int *index, int *parts)
+{
+    // move di parts forward (di > 0) or backward (di < 0), changing slide
+    // when no part is left on the current one
+
+    if ((di > 0 && *parts < buf[*index].nb_parts) || (di < 0 && *parts > 1)) {
+        *parts = MAP(*parts + di, 1, buf[*index].nb_parts);
+    } else if ((di > 0 && *index < nb_slides - 1) || (di < 0 && *index > 0)) {
+        *index = MAP(*index + di, 0, nb_slides - 1);
+        *parts = (di > 0) ? 1 : buf[*index].nb_parts;
+    }
+}
+
+void
+render_step(struct slide *buf, int i, int index, int parts)
+{
+    // render ahead the frame a step forward (i == 0) or backward (i == 1)
+    // from the given position would present, leaving it in the back buffer;
+    // laid out apart, so that the slide shown keeps its layout
+
+    struct layout shown;
+    struct slide *s;
+    int scroll = 0, hscroll = 0;
+    int64_t start = now_us();
+
+    step(buf, i ? -1 : 1, &index, &parts);
+    steps[i].index = index;
+    steps[i].parts = parts;
+    s = load_slide(buf, index);
+    shown = lay;
+    lay = ahead;
+    if (i == 0)
+        lay.shown = 0;              // the back buffer holds the slide shown
+    display_slide(*s, index + 1, parts, &scroll, &hscroll);
+    tb_render_frame(&steps[i].frame);
+    ahead = lay;
+    lay = shown;
+    lay.shown = 0;
+    trace_span("render", start, index + 1, -1);
+}
+
+void
+format_ruler(char *ruler, int index)
+{
+    // write the position in the deck, with a spinner if a slide not read yet
+    // is waited for
+
+    if (!loading)
+        sprintf(ruler, "%d/%d", index, nb_slides);
+    else if (want < 0)
+        sprintf(ruler, "%d/?", index);
+    else
+        sprintf(ruler, "%c %d/?", "|/-\\"[now_us()/(1000*SPINNER_MS) % 4],
+            index);
+}
+
+void
+wait_input(struct tb_event *ev, struct slide **buf)
+{
+    // wait for an event while the deck is read in the background; ev->type
+    // is 0 if the screen needs to be redrawn instead
+
+    struct pollfd fds[3];
+    int n;
+
+    if (!loading) {
+        tb_poll_event(ev);
+        return;
+    }
+    tb_get_fds(&fds[0].fd, &fds[1].fd);
+    fds[2].fd = parser.notify[0];
+    fds[0].events = fds[1].events = fds[2].events = POLLIN;
+    while (tb_peek_event(ev, 0) == TB_ERR_NO_EVENT) {
+        n = poll(fds, 3, (want >= 0) ? SPINNER_MS : -1);
+        if (n < 0 || (n > 0 && !fds[2].revents))
+            continue;
+        if (n > 0)
+            sync_deck(buf);
+        if (n == 0 || !loading || want >= 0) {
+            // the ruler changed, so did the frames rendered ahead
+            lay.shown = 0;
+            steps[0].index = steps[1].index = -1;
+            ev->type = 0;
+            return;
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct slide *buf;              // buffer of pointers to slides
+    struct tb_event ev;             // struct to retrieve events
+    int m = 0;                      // multiplier
+    int index = 0;
+    int displayed_parts = 1;
+    int scroll = 0, hscroll = 0;    // rows and columns scrolled, see
+                                    // display_slide()
+    int scrolled_index = 0, scrolled_parts = 1; // where scroll applies
+    int outline = 0;                // outline displayed instead of slides
+    int prompt = 0;                 // search query being typed
+    int selected = 0;               // heading selected in the outline
+    int overlay;                    // outline, prompt or HUD on screen
+    struct tb_event deferred[MAX_DEFERRED]; // keys typed while waiting
+    int first_deferred = 0, nb_deferred = 0;
+    int di, i;
+    struct frame_stats *f;
+    int64_t t;
+    char *filename = NULL;
+
+    // parsing arguments
+    for (i = 1; i < argc; i++) {
+        if (!(strcmp(argv[i], "--help") && strcmp(argv[i], "-h"))) {
+            printf("%s\n", HELP_MESSAGE);
+            return 0;
+        } else if (!(strcmp(argv[i], "--version") && strcmp(argv[i], "-v"))) {
+            printf("%s\n", VERSION);
+            return 0;
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            if ((trace_file = fopen(argv[++i], "w")) == NULL)
+                exit(ERR_FILE_CONNECTION);
+            trace_epoch = now_us();
+            atexit(trace_dump);
+        } else if (!strcmp(argv[i], "--mem-stats")) {
+            mem_stats = 1;
+            atexit(mem_report);
+        } else if (!strcmp(argv[i], "--window") && i + 1 < argc) {
+            window_cap = (size_t) strtoul(argv[++i], NULL, 10) << 20;
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        printf("%s\n", HELP_MESSAGE);
+        return 0;
+    }
+    strcpy(title, DEFAULT_TITLE);
+    strcpy(author, DEFAULT_AUTHOR);
+
+    // read the first slide, the rest is read once it is displayed
+    parse_open(filename);
+    while (parser.nb_slides == 0 && !parse_more())
+        ;
+    buf = NULL;
+    sync_deck(&buf);
+
+    // init termbox
+    tb_init();
+    tb_set_output_mode(OUTPUT_MODE);
+    tb_set_clear_attrs(COLOR_DEFAULT, COLOR_BG);
+    resize(tb_width(), tb_height());
+
+    // main loop
+    while (1) {
+        f = &hud[hud_frames % HUD_HISTORY];
+        overlay = outline || prompt || show_hud || want >= 0;
+
+        // scrolling is undone by any step
+        if (index != scrolled_index || displayed_parts != scrolled_parts) {
+            scroll = hscroll = 0;
+            scrolled_index = index;
+            scrolled_parts = displayed_parts;
+        }
+
+        // a step rendered ahead is written as is if the screen allows it
+        for (i = 0; i < 2 && !overlay; i++) {
+            if (steps[i].index != index || steps[i].parts != displayed_parts ||
+                scroll != 0 || hscroll != 0)
+                continue;
+            t = now_us();
+            if (tb_present_frame(steps[i].frame) == TB_OK)
+                break;
+        }
+        if (i < 2 && !overlay) {
+            // the back buffer now holds the frame, not the laid out slide
+            lay.shown = 0;
+            f->layout_us = 0;
+        } else {
+            t = now_us();
+            if (outline)
+                display_outline(selected);
+            else
+                display_slide(*load_slide(buf, index), index + 1,
+                    displayed_parts, &scroll, &hscroll);
+            f->layout_us = now_us() - t;
+            if (show_hud)
+                display_hud(index + 1);
+            if (prompt)
+                display_prompt();
+            t = now_us();
+            tb_present();
+        }
+        f->present_us = now_us() - t;
+        trace_span("present", t, index + 1, -1);
+        tb_present_stats(&f->bytes, &f->cells);
+        hud_frames++;
+        if (loading && !parser.started)
+            parse_start();
+
+        // keys typed while waiting for a slide apply once it is there
+        if (want < 0 && first_deferred < nb_deferred) {
+            ev = deferred[first_deferred++];
+            if (first_deferred == nb_deferred)
+                first_deferred = nb_deferred = 0;
+        } else {
+            // while idle, render the next and previous steps
+            t = now_us();
+            for (i = 0; tb_peek_event(&ev, 0) == TB_ERR_NO_EVENT; i++) {
+                if (i == 2 || overlay) {
+                    wait_input(&ev, &buf);
+                    break;
+                }
+                render_step(buf, i, index, displayed_parts);
+            }
+            trace_span("wait", t, -1, -1);
+        }
+        if (want >= 0 && (want < nb_slides || !loading)) {
+            index = MIN(want, nb_slides - 1);
+            displayed_parts = 1;
+            want = -1;
+        }
+
+        if (ev.type == TB_EVENT_RESIZE)
             resize(ev.w, ev.h);
         if (ev.type != TB_EVENT_KEY)
             continue;
+        if (want >= 0 && ev.ch != 'q' && ev.key != TB_KEY_ESC) {
+            if (nb_deferred < MAX_DEFERRED)
+                deferred[nb_deferred++] = ev;
+            continue;
+        }
+        if (prompt) {
+            if (ev.key == TB_KEY_ESC) {
+                prompt = 0;
+                query[query_len = 0] = '\0';
+                search(buf);
+            } else if (ev.key == TB_KEY_ENTER) {
+                prompt = 0;
+                search(buf);
+                next_hit(0, &index, &displayed_parts);
+            } else if (ev.key == TB_KEY_BACKSPACE ||
+                ev.key == TB_KEY_BACKSPACE2) {
+                while (query_len > 0 && (query[--query_len] & 0xc0) == 0x80)
+                    ;
+                query[query_len] = '\0';
+            } else if (ev.ch && query_len + 4 < (int) sizeof(query)) {
+                query_len += tb_utf8_unicode_to_char(&(query[query_len]),
+                    ev.ch);
+                query[query_len] = '\0';
+            }
+            continue;
+        }
         if ((m && ev.ch == '0') || ('1' <= ev.ch && ev.ch <= '9')) {
             m = 10*m + ev.ch - '0';
             continue;
         }
         if (m == 0)
             m = 1;
+        want = -1;
+        if (outline) {
+            di = 0;
+            if (ev.ch == 'q') {
+                tb_shutdown();
+                return 0;
+            } else if (ev.ch == 'j' || ev.key == TB_KEY_ARROW_DOWN) {
+                di = m;
+            } else if (ev.ch == 'k' || ev.key == TB_KEY_ARROW_UP) {
+                di = -m;
+            } else if (ev.ch == 'g' || ev.ch == 'G') {
+                di = ((ev.ch == 'g') ? m : nb_headings) - 1 - selected;
+            } else if (ev.ch == 'o' || ev.key == TB_KEY_ESC) {
+                outline = 0;
+            } else if ((ev.ch == ' ' || ev.key == TB_KEY_ENTER) &&
+                nb_headings > 0 && headings[selected].slide < nb_slides) {
+                index = headings[selected].slide;
+                displayed_parts = headings[selected].part;
+                outline = 0;
+            }
+            selected = MAP(selected + di, 0, nb_headings - 1);
+            m = 0;
+            continue;
+        }
         if (ev.ch) {
             switch (ev.ch) {
             case 'q':
                 tb_shutdown();
                 return 0;
+            case 'p':
+                show_hud ^= 1;
+                m = 0;
+                continue;
+            case '/':
+                query[query_len = 0] = '\0';
+                prompt = 1;
+                m = 0;
+                continue;
+            case 'n':
+            case 'N':
+                while (m--)
+                    next_hit((ev.ch == 'n') ? 1 : -1, &index,
+                        &displayed_parts);
+                m = 0;
+                continue;
+            case 'o':
+                // select the last heading before the current slide
+                for (selected = 0; selected + 1 < nb_headings &&
+                    headings[selected + 1].slide <= index; selected++)
+                    ;
+                outline = 1;
+                m = 0;
+                continue;
             case ' ':
             case 'j':
             case 'l':
@@ -468,10 +2933,22 @@ main(int argc, char *argv[])
             case 'h':
                 di = -m;
                 break;
+            case 'J':
+            case 'K':
+                scroll += (ev.ch == 'J') ? m : -m;
+                m = 0;
+                continue;
+            case 'H':
+            case 'L':
+                hscroll += ((ev.ch == 'L') ? m : -m)*(dw/2);
+                m = 0;
+                continue;
             case 'g':
             case 'G':
                 index = ((ev.ch == 'g') ? MIN(m, nb_slides) : nb_slides) - 1;
                 displayed_parts = 1;
+                if (loading && (ev.ch == 'G' || m > nb_slides))
+                    want = (ev.ch == 'g') ? m - 1 : INT_MAX;
                 m = 0;
                 continue;
             }
@@ -488,19 +2965,21 @@ main(int argc, char *argv[])
             case TB_KEY_ARROW_LEFT:
                 di = -m;
                 break;
+            case TB_KEY_PGDN:
+            case TB_KEY_PGUP:
+                scroll += (ev.key == TB_KEY_PGDN) ? height - 2 : 2 - height;
+                m = 0;
+                continue;
             case TB_KEY_ESC:
                 m = 0;
                 continue;
             }
         }
         m = 0;
-        if ((di > 0 && displayed_parts < buf[index].nb_parts) ||
-            (di < 0 && displayed_parts > 1)) {
-            displayed_parts = MAP(displayed_parts + di, 1, buf[index].nb_parts);
-        } else if ((di > 0 && index < nb_slides - 1) ||
-            (di < 0 && index > 0)) {
-            index = MAP(index + di, 0, nb_slides - 1);
-            displayed_parts = (di > 0) ? 1 : buf[index].nb_parts;
-        }
+        if (loading && di > 0 && index == nb_slides - 1 &&
+            displayed_parts == buf[index].nb_parts)
+            want = index + di;
+        else
+            step(buf, di, &index, &displayed_parts);
     }
 }
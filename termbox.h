@@ -44,13 +44,20 @@ SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
-#include <wchar.h>
+#ifdef TB_OPT_WRITER_THREAD
+#include <pthread.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -194,6 +201,12 @@ extern "C" {
 /* Some hard-coded caps */
 #define TB_HARDCAP_ENTER_MOUSE  "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define TB_HARDCAP_EXIT_MOUSE   "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
+#define TB_HARDCAP_BEGIN_SYNC   "\x1b[?2026h"
+#define TB_HARDCAP_END_SYNC     "\x1b[?2026l"
+#define TB_HARDCAP_QUERY_SIZE   "\x1b[9999;9999H\x1b[6n"
+#define TB_HARDCAP_QUERY_SYNC   "\x1b[?2026$p"
+#define TB_HARDCAP_QUERY_RGB    "\x1b[48:2:1:2:3m\x1bP$qm\x1b\\\x1b[m"
+#define TB_HARDCAP_QUERY_DA1    "\x1b[c"
 
 /* Colors (numeric) and attributes (bitwise) (tb_cell.fg, tb_cell.bg) */
 #define TB_BLACK                0x0001
@@ -236,6 +249,10 @@ extern "C" {
 #define TB_INPUT_ALT        2
 #define TB_INPUT_MOUSE      4
 
+/* Terminal features (bitwise) (tb_get_features) */
+#define TB_FEATURE_TRUECOLOR 1
+#define TB_FEATURE_SYNC      2
+
 /* Output modes (tb_set_output_mode) */
 #define TB_OUTPUT_CURRENT   0
 #define TB_OUTPUT_NORMAL    1
@@ -275,6 +292,7 @@ extern "C" {
 #define TB_ERR_RESIZE_READ      -20
 #define TB_ERR_RESIZE_SSCANF    -21
 #define TB_ERR_CAP_COLLISION    -22
+#define TB_ERR_STALE_FRAME      -23
 
 #define TB_ERR_SELECT           TB_ERR_POLL
 #define TB_ERR_RESIZE_SELECT    TB_ERR_RESIZE_POLL
@@ -291,12 +309,27 @@ extern "C" {
 #endif
 
 /* Define this to set the size of the read buffer used when reading
- * from the tty
+ * from the tty. More is read when more input is pending.
  */
 #ifndef TB_OPT_READ_BUF
 #define TB_OPT_READ_BUF 64
 #endif
 
+/* Define this to set how many events decoded from a single read are queued
+ * for the next calls to tb_peek_event() / tb_poll_event()
+ */
+#ifndef TB_OPT_EVENT_QUEUE
+#define TB_OPT_EVENT_QUEUE 256
+#endif
+
+/* Define this to set how long the answers to the terminal queries sent by
+ * tb_init() are waited for, in milliseconds. Past it, input that looks like
+ * an answer is decoded as keys.
+ */
+#ifndef TB_OPT_PROBE_TIMEOUT_MS
+#define TB_OPT_PROBE_TIMEOUT_MS 1000
+#endif
+
 /* Define this for limited back compat with termbox v1 */
 #ifdef TB_OPT_V1_COMPAT
 #define tb_change_cell          tb_set_cell
@@ -306,6 +339,24 @@ extern "C" {
 #define tb_select_output_mode   tb_set_output_mode
 #endif
 
+/* Define this to cache the resolved terminfo caps and the key sequence table
+ * in $XDG_CACHE_HOME/termbox-$TERM (or ~/.cache/termbox-$TERM). The cache is
+ * keyed by $TERM, the terminfo-related environment and the modification time
+ * of the terminfo file, so that a warm tb_init() maps a single file instead of
+ * probing the terminfo directories and rebuilding the table.
+ */
+#ifdef TB_OPT_CAP_CACHE
+#define TB_CAP_CACHE_MAGIC   "tbcaps"
+#define TB_CAP_CACHE_VERSION 2
+#endif
+
+/* Define this to write to the tty from a separate thread (link with -pthread),
+ * so that tb_present() never waits on a slow tty. The thread is fed a single
+ * pending frame: if it has not picked the last one up when the next one is
+ * presented, the last one is dropped and the next one is diffed against the
+ * screen it was about to replace, so that only the latest state is written.
+ */
+
 /* Define these to swap in a different allocator */
 #ifndef tb_malloc
 #define tb_malloc  malloc
@@ -313,6 +364,15 @@ extern "C" {
 #define tb_free    free
 #endif
 
+/* Define these to trace time spent in termbox internals. tb_trace_begin()
+ * returns a timestamp that is handed back to tb_trace_end() with the name of
+ * the span when it completes.
+ */
+#ifndef tb_trace_begin
+#define tb_trace_begin()          0
+#define tb_trace_end(name, start) (void)(start)
+#endif
+
 #ifdef TB_OPT_TRUECOLOR
 typedef uint32_t uintattr_t;
 #else
@@ -320,13 +380,14 @@ typedef uint16_t uintattr_t;
 #endif
 
 /* The terminal screen is represented as 2d array of cells. The structure is
- * optimized for dealing with single-width (wcwidth()==1) Unicode code points,
- * however some support for grapheme clusters (e.g., combining diacritical
- * marks) and wide code points (e.g., Hiragana) is provided through ech, nech,
- * cech via tb_set_cell_ex(). ech is only valid when nech>0, otherwise ch is
- * used.
+ * optimized for dealing with single-width (tb_wcwidth()==1) Unicode code
+ * points, however some support for grapheme clusters (e.g., combining
+ * diacritical marks) and wide code points (e.g., Hiragana) is provided through
+ * ech, nech, cech via tb_set_cell_ex(). ech is only valid when nech>0,
+ * otherwise ch is used.
  *
- * For non-single-width code points, given N=wcwidth(ch)/wcswidth(ech):
+ * For non-single-width code points, given N=tb_wcwidth(ch), or its sum over
+ * the code points of ech:
  *
  *   when N==0: termbox forces a single-width cell. Callers should avoid this
  *              if aiming to render text accurately.
@@ -404,6 +465,28 @@ int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg);
 /* Synchronizes the internal back buffer with the terminal by writing to tty. */
 int tb_present(void);
 
+/* Returns the number of bytes written to the tty and the number of cells that
+ * changed during the last tb_present() call. Either pointer may be NULL.
+ */
+int tb_present_stats(size_t *out_bytes, int *out_cells);
+
+/* Renders the back buffer into a frame: the bytes tb_present() would write
+ * right now and the cells they would leave on the screen. Neither the tty nor
+ * the internal buffers are touched, so that frames can be rendered ahead of
+ * time, e.g. while waiting for input. *frame is allocated on the first call
+ * and reused by the next ones.
+ *
+ * tb_present_frame() writes a frame with a single write() call and makes its
+ * cells both the back buffer and the screen contents. A frame only applies to
+ * the screen it was rendered against: once anything else was presented, the
+ * terminal resized or the cursor moved, TB_ERR_STALE_FRAME is returned and
+ * nothing is written, tb_present() has to be used instead.
+ */
+struct tb_frame;
+int tb_render_frame(struct tb_frame **frame);
+int tb_present_frame(struct tb_frame *frame);
+int tb_free_frame(struct tb_frame *frame);
+
 /* Sets the position of the cursor. Upper-left character is (0, 0). */
 int tb_set_cursor(int cx, int cy);
 int tb_hide_cursor(void);
@@ -424,6 +507,14 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg);
 int tb_extend_cell(int x, int y, uint32_t ch);
 
+/* Copies a w x h rectangle of cells to the internal back buffer, with its
+ * upper-left corner at (x, y). ch, fg and bg hold w * h code points and
+ * attributes, row by row. Cells outside of the screen are ignored, copied
+ * cells hold a single code point.
+ */
+int tb_blit(int x, int y, int w, int h, const uint32_t *ch,
+    const uintattr_t *fg, const uintattr_t *bg);
+
 /* Sets the input mode. Termbox has two input modes:
  *
  * 1. TB_INPUT_ESC
@@ -537,6 +628,15 @@ int tb_poll_event(struct tb_event *event);
  * tb_poll_event() / tb_peek_event() if activity is detected. */
 int tb_get_fds(int *ttyfd, int *resizefd);
 
+/* Returns the TB_FEATURE_* flags reported by the terminal. tb_init() queries
+ * the terminal without waiting for its answers, which are consumed by
+ * tb_peek_event() / tb_poll_event() as they arrive: the flags may be set
+ * after a few events. If the terminal size is not available through
+ * TIOCGWINSZ, an 80x24 screen is assumed until the terminal reports its size,
+ * which is delivered as a TB_EVENT_RESIZE.
+ */
+int tb_get_features(void);
+
 /* Print and printf functions. Specify param out_w to determine width of printed
  * string.
  */
@@ -568,9 +668,16 @@ int tb_set_func(int fn_type, int (*fn)(struct tb_event *, size_t *));
 int tb_utf8_char_length(char c);
 int tb_utf8_char_to_unicode(uint32_t *out, const char *c);
 int tb_utf8_unicode_to_char(char *out, uint32_t c);
+
+/* Returns the number of columns taken by code point ch: 0 for NUL, combining
+ * marks and other zero-width characters, 2 for East Asian wide and fullwidth
+ * characters, -1 for other control characters and 1 otherwise. Unlike
+ * wcwidth(), it does not depend on the locale and only searches a table above
+ * U+02FF.
+ */
+int tb_wcwidth(uint32_t ch);
 int tb_last_errno(void);
 const char *tb_strerror(int err);
-struct tb_cell *tb_cell_buffer(void);
 int tb_has_truecolor(void);
 int tb_has_egc(void);
 const char *tb_version(void);
@@ -620,10 +727,37 @@ struct bytebuf_t {
     size_t cap;
 };
 
+#ifdef TB_OPT_EGC
+struct cellbuf_ech_t {
+    uint32_t *ech;
+    size_t nech;
+    size_t cech;
+};
+#endif
+
 struct cellbuf_t {
     int width;
     int height;
-    struct tb_cell *cells;
+    uint32_t *ch;
+    uintattr_t *fg;
+    uintattr_t *bg;
+    uint8_t *dirty; // rows changed since the last tb_present()
+#ifdef TB_OPT_EGC
+    struct cellbuf_ech_t *ech; // allocated on the first grapheme cluster
+    size_t nclusters;          // cells of ech with nech > 0
+#endif
+};
+
+struct tb_frame {
+    struct bytebuf_t out;
+    struct cellbuf_t cells;
+    unsigned long front_gen; // screen it was rendered against
+    int cursor_x;
+    int cursor_y;
+    int output_mode;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+    int ncells;
 };
 
 struct cap_trie_t {
@@ -635,6 +769,31 @@ struct cap_trie_t {
     uint8_t mod;
 };
 
+#define CAP_STATE_LEAF   1
+#define CAP_STATE_BRANCH 2
+
+struct cap_state_t {
+    uint16_t key;
+    uint8_t mod;
+    uint8_t flags;
+};
+
+#ifdef TB_OPT_CAP_CACHE
+struct cap_cache_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t ncaps;
+    uint64_t env_hash;
+    int64_t terminfo_mtime;
+    int64_t terminfo_size;
+    char terminfo_path[PATH_MAX];
+    uint32_t cap_offsets[TB_CAP__COUNT];
+    uint32_t nstates;
+    uint32_t nclasses;
+    uint32_t nstrs;
+};
+#endif
+
 struct tb_global_t {
     int ttyfd;
     int rfd;
@@ -655,15 +814,52 @@ struct tb_global_t {
     int output_mode;
     char *terminfo;
     size_t nterminfo;
+    char terminfo_path[PATH_MAX];
+    struct stat terminfo_st;
     const char *caps[TB_CAP__COUNT];
     struct cap_trie_t cap_trie;
+    char *cap_dfa;
+    size_t ncap_dfa;
+    const uint8_t *cap_classes;
+    const struct cap_state_t *cap_states;
+    const uint16_t *cap_trans;
+    size_t ncap_states;
+    size_t ncap_classes;
+    struct tb_event events[TB_OPT_EVENT_QUEUE];
+    size_t first_event;
+    size_t nevents;
+    void *cap_cache;
+    size_t ncap_cache;
     struct bytebuf_t in;
     struct bytebuf_t out;
     struct cellbuf_t back;
     struct cellbuf_t front;
+    unsigned long front_gen; // bumped whenever the screen changes
+#ifdef TB_OPT_WRITER_THREAD
+    pthread_t writer;
+    pthread_mutex_t writer_mutex;
+    pthread_cond_t writer_cond;
+    int writer_started;
+    int writer_quit;
+    int writer_failed;
+    struct bytebuf_t pending;   // handed over, not picked up by the writer yet
+    struct bytebuf_t writing;   // being written by the writer
+    int pending_droppable;      // pending only holds a frame
+    struct cellbuf_t unsent;    // screen before the pending frame
+    uintattr_t unsent_fg;
+    uintattr_t unsent_bg;
+#endif
     struct termios orig_tios;
     int has_orig_tios;
     int last_errno;
+    size_t present_bytes;
+    int present_cells;
+    int features;
+    int probe_sent;
+    int probe_pending;          // DA1 queries not answered yet
+    int probe_cpr;              // position query not answered yet
+    int probe_rqss;             // DECRQSS query not answered yet
+    int64_t probe_deadline;     // when unanswered queries are given up on
     int initialized;
     int (*fn_extract_esc_pre)(struct tb_event *, size_t *);
     int (*fn_extract_esc_post)(struct tb_event *, size_t *);
@@ -1356,21 +1552,160 @@ static const unsigned char utf8_length[256] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 
 static const unsigned char utf8_mask[6] = {0x7f, 0x1f, 0x0f, 0x07, 0x03, 0x01};
 
+struct width_range_t {
+    uint32_t first;
+    uint32_t last;
+};
+
+// Combining marks, format characters and Hangul medial vowels, which take
+// no column (Unicode 14.0)
+static const struct width_range_t width_zero[] = {
+    {0x300, 0x36F}, {0x483, 0x489}, {0x591, 0x5BD}, {0x5BF, 0x5BF},
+    {0x5C1, 0x5C2}, {0x5C4, 0x5C5}, {0x5C7, 0x5C7}, {0x600, 0x605},
+    {0x610, 0x61A}, {0x61C, 0x61C}, {0x64B, 0x65F}, {0x670, 0x670},
+    {0x6D6, 0x6DD}, {0x6DF, 0x6E4}, {0x6E7, 0x6E8}, {0x6EA, 0x6ED},
+    {0x70F, 0x70F}, {0x711, 0x711}, {0x730, 0x74A}, {0x7A6, 0x7B0},
+    {0x7EB, 0x7F3}, {0x7FD, 0x7FD}, {0x816, 0x819}, {0x81B, 0x823},
+    {0x825, 0x827}, {0x829, 0x82D}, {0x859, 0x85B}, {0x890, 0x89F},
+    {0x8CA, 0x902}, {0x93A, 0x93A}, {0x93C, 0x93C}, {0x941, 0x948},
+    {0x94D, 0x94D}, {0x951, 0x957}, {0x962, 0x963}, {0x981, 0x981},
+    {0x9BC, 0x9BC}, {0x9C1, 0x9C4}, {0x9CD, 0x9CD}, {0x9E2, 0x9E3},
+    {0x9FE, 0xA02}, {0xA3C, 0xA3C}, {0xA41, 0xA51}, {0xA70, 0xA71},
+    {0xA75, 0xA75}, {0xA81, 0xA82}, {0xABC, 0xABC}, {0xAC1, 0xAC8},
+    {0xACD, 0xACD}, {0xAE2, 0xAE3}, {0xAFA, 0xB01}, {0xB3C, 0xB3C},
+    {0xB3F, 0xB3F}, {0xB41, 0xB44}, {0xB4D, 0xB56}, {0xB62, 0xB63},
+    {0xB82, 0xB82}, {0xBC0, 0xBC0}, {0xBCD, 0xBCD}, {0xC00, 0xC00},
+    {0xC04, 0xC04}, {0xC3C, 0xC3C}, {0xC3E, 0xC40}, {0xC46, 0xC56},
+    {0xC62, 0xC63}, {0xC81, 0xC81}, {0xCBC, 0xCBC}, {0xCBF, 0xCBF},
+    {0xCC6, 0xCC6}, {0xCCC, 0xCCD}, {0xCE2, 0xCE3}, {0xD00, 0xD01},
+    {0xD3B, 0xD3C}, {0xD41, 0xD44}, {0xD4D, 0xD4D}, {0xD62, 0xD63},
+    {0xD81, 0xD81}, {0xDCA, 0xDCA}, {0xDD2, 0xDD6}, {0xE31, 0xE31},
+    {0xE34, 0xE3A}, {0xE47, 0xE4E}, {0xEB1, 0xEB1}, {0xEB4, 0xEBC},
+    {0xEC8, 0xECD}, {0xF18, 0xF19}, {0xF35, 0xF35}, {0xF37, 0xF37},
+    {0xF39, 0xF39}, {0xF71, 0xF7E}, {0xF80, 0xF84}, {0xF86, 0xF87},
+    {0xF8D, 0xFBC}, {0xFC6, 0xFC6}, {0x102D, 0x1030}, {0x1032, 0x1037},
+    {0x1039, 0x103A}, {0x103D, 0x103E}, {0x1058, 0x1059}, {0x105E, 0x1060},
+    {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108D, 0x108D},
+    {0x109D, 0x109D}, {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714},
+    {0x1732, 0x1733}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17B4, 0x17B5},
+    {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x17DD, 0x17DD},
+    {0x180B, 0x180F}, {0x1885, 0x1886}, {0x18A9, 0x18A9}, {0x1920, 0x1922},
+    {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18},
+    {0x1A1B, 0x1A1B}, {0x1A56, 0x1A56}, {0x1A58, 0x1A60}, {0x1A62, 0x1A62},
+    {0x1A65, 0x1A6C}, {0x1A73, 0x1A7F}, {0x1AB0, 0x1B03}, {0x1B34, 0x1B34},
+    {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42}, {0x1B6B, 0x1B73},
+    {0x1B80, 0x1B81}, {0x1BA2, 0x1BA5}, {0x1BA8, 0x1BA9}, {0x1BAB, 0x1BAD},
+    {0x1BE6, 0x1BE6}, {0x1BE8, 0x1BE9}, {0x1BED, 0x1BED}, {0x1BEF, 0x1BF1},
+    {0x1C2C, 0x1C33}, {0x1C36, 0x1C37}, {0x1CD0, 0x1CD2}, {0x1CD4, 0x1CE0},
+    {0x1CE2, 0x1CE8}, {0x1CED, 0x1CED}, {0x1CF4, 0x1CF4}, {0x1CF8, 0x1CF9},
+    {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x206F},
+    {0x20D0, 0x20F0}, {0x2CEF, 0x2CF1}, {0x2D7F, 0x2D7F}, {0x2DE0, 0x2DFF},
+    {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672}, {0xA674, 0xA67D},
+    {0xA69E, 0xA69F}, {0xA6F0, 0xA6F1}, {0xA802, 0xA802}, {0xA806, 0xA806},
+    {0xA80B, 0xA80B}, {0xA825, 0xA826}, {0xA82C, 0xA82C}, {0xA8C4, 0xA8C5},
+    {0xA8E0, 0xA8F1}, {0xA8FF, 0xA8FF}, {0xA926, 0xA92D}, {0xA947, 0xA951},
+    {0xA980, 0xA982}, {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9}, {0xA9BC, 0xA9BD},
+    {0xA9E5, 0xA9E5}, {0xAA29, 0xAA2E}, {0xAA31, 0xAA32}, {0xAA35, 0xAA36},
+    {0xAA43, 0xAA43}, {0xAA4C, 0xAA4C}, {0xAA7C, 0xAA7C}, {0xAAB0, 0xAAB0},
+    {0xAAB2, 0xAAB4}, {0xAAB7, 0xAAB8}, {0xAABE, 0xAABF}, {0xAAC1, 0xAAC1},
+    {0xAAEC, 0xAAED}, {0xAAF6, 0xAAF6}, {0xABE5, 0xABE5}, {0xABE8, 0xABE8},
+    {0xABED, 0xABED}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0xFFF9, 0xFFFB}, {0x101FD, 0x101FD}, {0x102E0, 0x102E0},
+    {0x10376, 0x1037A}, {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F},
+    {0x10AE5, 0x10AE6}, {0x10D24, 0x10D27}, {0x10EAB, 0x10EAC},
+    {0x10F46, 0x10F50}, {0x10F82, 0x10F85}, {0x11001, 0x11001},
+    {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074},
+    {0x1107F, 0x11081}, {0x110B3, 0x110B6}, {0x110B9, 0x110BA},
+    {0x110BD, 0x110BD}, {0x110C2, 0x110CD}, {0x11100, 0x11102},
+    {0x11127, 0x1112B}, {0x1112D, 0x11134}, {0x11173, 0x11173},
+    {0x11180, 0x11181}, {0x111B6, 0x111BE}, {0x111C9, 0x111CC},
+    {0x111CF, 0x111CF}, {0x1122F, 0x11231}, {0x11234, 0x11234},
+    {0x11236, 0x11237}, {0x1123E, 0x1123E}, {0x112DF, 0x112DF},
+    {0x112E3, 0x112EA}, {0x11300, 0x11301}, {0x1133B, 0x1133C},
+    {0x11340, 0x11340}, {0x11366, 0x11374}, {0x11438, 0x1143F},
+    {0x11442, 0x11444}, {0x11446, 0x11446}, {0x1145E, 0x1145E},
+    {0x114B3, 0x114B8}, {0x114BA, 0x114BA}, {0x114BF, 0x114C0},
+    {0x114C2, 0x114C3}, {0x115B2, 0x115B5}, {0x115BC, 0x115BD},
+    {0x115BF, 0x115C0}, {0x115DC, 0x115DD}, {0x11633, 0x1163A},
+    {0x1163D, 0x1163D}, {0x1163F, 0x11640}, {0x116AB, 0x116AB},
+    {0x116AD, 0x116AD}, {0x116B0, 0x116B5}, {0x116B7, 0x116B7},
+    {0x1171D, 0x1171F}, {0x11722, 0x11725}, {0x11727, 0x1172B},
+    {0x1182F, 0x11837}, {0x11839, 0x1183A}, {0x1193B, 0x1193C},
+    {0x1193E, 0x1193E}, {0x11943, 0x11943}, {0x119D4, 0x119DB},
+    {0x119E0, 0x119E0}, {0x11A01, 0x11A0A}, {0x11A33, 0x11A38},
+    {0x11A3B, 0x11A3E}, {0x11A47, 0x11A47}, {0x11A51, 0x11A56},
+    {0x11A59, 0x11A5B}, {0x11A8A, 0x11A96}, {0x11A98, 0x11A99},
+    {0x11C30, 0x11C3D}, {0x11C3F, 0x11C3F}, {0x11C92, 0x11CA7},
+    {0x11CAA, 0x11CB0}, {0x11CB2, 0x11CB3}, {0x11CB5, 0x11CB6},
+    {0x11D31, 0x11D45}, {0x11D47, 0x11D47}, {0x11D90, 0x11D91},
+    {0x11D95, 0x11D95}, {0x11D97, 0x11D97}, {0x11EF3, 0x11EF4},
+    {0x13430, 0x13438}, {0x16AF0, 0x16AF4}, {0x16B30, 0x16B36},
+    {0x16F4F, 0x16F4F}, {0x16F8F, 0x16F92}, {0x16FE4, 0x16FE4},
+    {0x1BC9D, 0x1BC9E}, {0x1BCA0, 0x1CF46}, {0x1D167, 0x1D169},
+    {0x1D173, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD},
+    {0x1D242, 0x1D244}, {0x1DA00, 0x1DA36}, {0x1DA3B, 0x1DA6C},
+    {0x1DA75, 0x1DA75}, {0x1DA84, 0x1DA84}, {0x1DA9B, 0x1DAAF},
+    {0x1E000, 0x1E02A}, {0x1E130, 0x1E136}, {0x1E2AE, 0x1E2AE},
+    {0x1E2EC, 0x1E2EF}, {0x1E8D0, 0x1E8D6}, {0x1E944, 0x1E94A},
+    {0xE0001, 0xE01EF},
+};
+
+// East Asian wide and fullwidth code points, which take 2 columns
+// (Unicode 14.0)
+static const struct width_range_t width_wide[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x3029},
+    {0x302E, 0x303E}, {0x3041, 0x3096}, {0x309B, 0x3247}, {0x3250, 0x4DBF},
+    {0x4E00, 0xA4C6}, {0xA960, 0xA97C}, {0xAC00, 0xD7A3}, {0xF900, 0xFAD9},
+    {0xFE10, 0xFE19}, {0xFE30, 0xFE6B}, {0xFF01, 0xFF60}, {0xFFE0, 0xFFE6},
+    {0x16FE0, 0x16FE3}, {0x16FF0, 0x1B2FB}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C},
+    {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3},
+    {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E},
+    {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D},
+    {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A},
+    {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F},
+    {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+    {0x1F6D5, 0x1F6DF}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC},
+    {0x1F7E0, 0x1F7F0}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945},
+    {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAF6}, {0x20000, 0x3FFFD},
+};
+
 static int tb_reset(void);
 static int tb_printf_inner(int x, int y, uintattr_t fg, uintattr_t bg,
     size_t *out_w, const char *fmt, va_list vl);
 static int init_term_attrs(void);
 static int init_term_caps(void);
 static int init_cap_trie(void);
+static int init_caps(void);
 static int cap_trie_add(const char *cap, uint16_t key, uint8_t mod);
-static int cap_trie_find(const char *buf, size_t nbuf, struct cap_trie_t **last,
-    size_t *depth);
+static int cap_dfa_build(void);
+static size_t cap_dfa_size(size_t nstates, size_t nclasses);
+static void cap_dfa_attach(char *dfa, size_t nstates, size_t nclasses);
+static int cap_dfa_find(const char *buf, size_t nbuf,
+    const struct cap_state_t **last, size_t *depth);
 static int cap_trie_deinit(struct cap_trie_t *node);
+#ifdef TB_OPT_CAP_CACHE
+static int get_cap_cache_path(char *path, size_t npath);
+static uint64_t get_cap_cache_env_hash(void);
+static int load_cap_cache(void);
+static int save_cap_cache(void);
+#endif
 static int init_resize_handler(void);
 static int send_init_escape_codes(void);
 static int send_clear(void);
 static int update_term_size(void);
-static int update_term_size_via_esc(void);
+static int send_probe(void);
+static int64_t monotonic_ms(void);
+static int probe_expired(void);
 static int init_cellbuf(void);
 static int tb_deinit(void);
 static int load_terminfo(void);
@@ -1381,7 +1716,10 @@ static int load_builtin_caps(void);
 static const char *get_terminfo_string(int16_t str_offsets_pos,
     int16_t str_table_pos, int16_t str_table_len, int16_t str_index);
 static int wait_event(struct tb_event *event, int timeout);
+static int read_input(void);
+static int extract_events(struct tb_event *event);
 static int extract_event(struct tb_event *event);
+static int extract_probe_reply(struct tb_event *event);
 static int extract_esc(struct tb_event *event);
 static int extract_esc_user(struct tb_event *event, int is_post);
 static int extract_esc_cap(struct tb_event *event);
@@ -1394,18 +1732,32 @@ static int send_sgr(uintattr_t fg, uintattr_t bg, uintattr_t fg_is_default,
 static int send_cursor_if(int x, int y);
 static int send_char(int x, int y, uint32_t ch);
 static int send_cluster(int x, int y, uint32_t *ch, size_t nch);
+static int send_frame(struct cellbuf_t *front, int clean);
+static int flush_out(int droppable);
+#ifdef TB_OPT_WRITER_THREAD
+static int writer_start(void);
+static int writer_stop(void);
+static void *writer_run(void *arg);
+static int writer_supersede(int drop);
+static int writer_queue(struct bytebuf_t *b, int droppable);
+#endif
 static int convert_num(uint32_t num, char *buf);
-static int cell_cmp(struct tb_cell *a, struct tb_cell *b);
-static int cell_copy(struct tb_cell *dst, struct tb_cell *src);
-static int cell_set(struct tb_cell *cell, uint32_t *ch, size_t nch,
-    uintattr_t fg, uintattr_t bg);
-static int cell_reserve_ech(struct tb_cell *cell, size_t n);
-static int cell_free(struct tb_cell *cell);
+static size_t diff_index(const void *a, const void *b, size_t n, size_t size);
+static size_t wide_index(const uint32_t *ch, size_t n);
+static int cluster_width(const uint32_t *ech, size_t nech);
 static int cellbuf_init(struct cellbuf_t *c, int w, int h);
 static int cellbuf_free(struct cellbuf_t *c);
 static int cellbuf_clear(struct cellbuf_t *c);
-static int cellbuf_get(struct cellbuf_t *c, int x, int y, struct tb_cell **out);
+static int cellbuf_index(struct cellbuf_t *c, int x, int y, size_t *out);
+static int cellbuf_set(struct cellbuf_t *c, size_t i, uint32_t *ch, size_t nch,
+    uintattr_t fg, uintattr_t bg);
+static int cellbuf_reserve_ech(struct cellbuf_t *c, size_t i, size_t n);
+static int cellbuf_cmp(struct cellbuf_t *a, struct cellbuf_t *b, size_t i);
+static int cellbuf_copy(struct cellbuf_t *dst, struct cellbuf_t *src, size_t i);
+static size_t cellbuf_next(struct cellbuf_t *back, struct cellbuf_t *front,
+    size_t i, size_t end);
 static int cellbuf_resize(struct cellbuf_t *c, int w, int h);
+static int cellbuf_assign(struct cellbuf_t *dst, struct cellbuf_t *src);
 static int bytebuf_puts(struct bytebuf_t *b, const char *str);
 static int bytebuf_nputs(struct bytebuf_t *b, const char *str, size_t nstr);
 static int bytebuf_shift(struct bytebuf_t *b, size_t n);
@@ -1444,13 +1796,16 @@ int tb_init_rwfd(int rfd, int wfd) {
 
     do {
         if_err_break(rv, init_term_attrs());
-        if_err_break(rv, init_term_caps());
-        if_err_break(rv, init_cap_trie());
+        if_err_break(rv, init_caps());
         if_err_break(rv, init_resize_handler());
         if_err_break(rv, send_init_escape_codes());
         if_err_break(rv, send_clear());
         if_err_break(rv, update_term_size());
+        if_err_break(rv, send_probe());
         if_err_break(rv, init_cellbuf());
+#ifdef TB_OPT_WRITER_THREAD
+        if_err_break(rv, writer_start());
+#endif
         global.initialized = 1;
     } while (0);
 
@@ -1496,63 +1851,104 @@ int tb_present(void) {
 
     // TODO Assert global.back.(width,height) == global.front.(width,height)
 
-    global.last_x = -1;
-    global.last_y = -1;
-
-    int x, y, i;
-    for (y = 0; y < global.front.height; y++) {
-        for (x = 0; x < global.front.width;) {
-            struct tb_cell *back, *front;
-            if_err_return(rv, cellbuf_get(&global.back, x, y, &back));
-            if_err_return(rv, cellbuf_get(&global.front, x, y, &front));
-
-            int w;
-            {
-#ifdef TB_OPT_EGC
-                if (back->nech > 0)
-                    w = wcswidth((wchar_t *)back->ech, back->nech);
-                else
+    int droppable = global.out.len == 0;
+#ifdef TB_OPT_WRITER_THREAD
+    if_err_return(rv, writer_supersede(1));
 #endif
-                    /* wcwidth() simply returns -1 on overflow of wchar_t */
-                    w = wcwidth((wchar_t)back->ch);
-            }
-            if (w < 1) {
-                w = 1;
-            }
+    if_err_return(rv, send_frame(&global.front, 1));
+    global.front_gen++;
+    global.present_bytes = global.out.len;
+    if_err_return(rv, flush_out(droppable));
 
-            if (cell_cmp(back, front) != 0) {
-                cell_copy(front, back);
+    return TB_OK;
+}
 
-                send_attr(back->fg, back->bg);
-                if (w > 1 && x >= global.front.width - (w - 1)) {
-                    for (i = x; i < global.front.width; i++) {
-                        send_char(i, y, ' ');
-                    }
-                } else {
-                    {
-#ifdef TB_OPT_EGC
-                        if (back->nech > 0)
-                            send_cluster(x, y, back->ech, back->nech);
-                        else
-#endif
-                            send_char(x, y, back->ch);
-                    }
-                    for (i = 1; i < w; i++) {
-                        struct tb_cell *front_wide;
-                        if_err_return(rv,
-                            cellbuf_get(&global.front, x + i, y, &front_wide));
-                        if_err_return(rv,
-                            cell_set(front_wide, 0, 1, back->fg, back->bg));
-                    }
-                }
-            }
-            x += w;
+int tb_present_stats(size_t *out_bytes, int *out_cells) {
+    if_not_init_return();
+    if (out_bytes)
+        *out_bytes = global.present_bytes;
+    if (out_cells)
+        *out_cells = global.present_cells;
+    return TB_OK;
+}
+
+int tb_render_frame(struct tb_frame **frame) {
+    if_not_init_return();
+    int rv;
+    struct tb_frame *f = *frame;
+    if (!f) {
+        if (!(f = tb_malloc(sizeof(*f)))) {
+            return TB_ERR_MEM;
         }
+        memset(f, 0, sizeof(*f));
+        *frame = f;
     }
 
-    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+    // Present into the frame instead of the tty and the front buffer
+    if_err_return(rv, cellbuf_assign(&f->cells, &global.front));
+    struct bytebuf_t out = global.out;
+    uintattr_t last_fg = global.last_fg, last_bg = global.last_bg;
+    int present_cells = global.present_cells;
+    global.out = f->out;
+    global.out.len = 0;
+    rv = send_frame(&f->cells, 0);
+    f->out = global.out;
+    f->last_fg = global.last_fg;
+    f->last_bg = global.last_bg;
+    f->ncells = global.present_cells;
+    global.out = out;
+    global.last_fg = last_fg;
+    global.last_bg = last_bg;
+    global.present_cells = present_cells;
+
+    f->front_gen = global.front_gen;
+    f->cursor_x = global.cursor_x;
+    f->cursor_y = global.cursor_y;
+    f->output_mode = global.output_mode;
+    return rv;
+}
+
+int tb_present_frame(struct tb_frame *frame) {
+    if_not_init_return();
+    int rv;
+    if (!frame || frame->front_gen != global.front_gen || global.out.len > 0 ||
+        frame->cursor_x != global.cursor_x ||
+        frame->cursor_y != global.cursor_y ||
+        frame->output_mode != global.output_mode) {
+        return TB_ERR_STALE_FRAME;
+    }
 
+    global.present_bytes = frame->out.len;
+    global.present_cells = frame->ncells;
+#ifdef TB_OPT_WRITER_THREAD
+    if (global.writer_started) {
+        // The frame was diffed against the pending one, which must stay
+        if_err_return(rv, writer_supersede(0));
+        if_err_return(rv, writer_queue(&frame->out, 1));
+    } else
+#endif
+        if_err_return(rv, bytebuf_flush(&frame->out, global.wfd));
+
+    // The frame's cells are on screen now, the old front buffer is recycled
+    // by the next tb_render_frame()
+    struct cellbuf_t front = global.front;
+    global.front = frame->cells;
+    frame->cells = front;
+    frame->front_gen = global.front_gen++;
+    global.last_fg = frame->last_fg;
+    global.last_bg = frame->last_bg;
+    if_err_return(rv, cellbuf_assign(&global.back, &global.front));
+    memset(global.back.dirty, 0, global.back.height);
+    return TB_OK;
+}
+
+int tb_free_frame(struct tb_frame *frame) {
+    if (!frame) {
+        return TB_OK;
+    }
+    bytebuf_free(&frame->out);
+    cellbuf_free(&frame->cells);
+    tb_free(frame);
     return TB_OK;
 }
 
@@ -1594,9 +1990,44 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg) {
     if_not_init_return();
     int rv;
-    struct tb_cell *cell;
-    if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
-    if_err_return(rv, cell_set(cell, ch, nch, fg, bg));
+    size_t i;
+    if_err_return(rv, cellbuf_index(&global.back, x, y, &i));
+    if_err_return(rv, cellbuf_set(&global.back, i, ch, nch, fg, bg));
+    global.back.dirty[y] = 1;
+    return TB_OK;
+}
+
+int tb_blit(int x, int y, int w, int h, const uint32_t *ch,
+    const uintattr_t *fg, const uintattr_t *bg) {
+    if_not_init_return();
+    struct cellbuf_t *back = &global.back;
+    int cx, cy, cw, row;
+
+    // Clip to the back buffer
+    cx = x < 0 ? 0 : x;
+    cy = y < 0 ? 0 : y;
+    cw = (x + w < back->width ? x + w : back->width) - cx;
+    if (cw <= 0) {
+        return TB_OK;
+    }
+
+    for (row = cy; row < y + h && row < back->height; row++) {
+        size_t dst = (size_t)row * back->width + cx;
+        size_t src = (size_t)(row - y) * w + (cx - x);
+        memcpy(&back->ch[dst], &ch[src], sizeof(*ch) * cw);
+        memcpy(&back->fg[dst], &fg[src], sizeof(*fg) * cw);
+        memcpy(&back->bg[dst], &bg[src], sizeof(*bg) * cw);
+        back->dirty[row] = 1;
+#ifdef TB_OPT_EGC
+        int i;
+        for (i = 0; back->nclusters > 0 && i < cw; i++) {
+            if (back->ech[dst + i].nech > 0) {
+                back->ech[dst + i].nech = 0;
+                back->nclusters--;
+            }
+        }
+#endif
+    }
     return TB_OK;
 }
 
@@ -1604,21 +2035,26 @@ int tb_extend_cell(int x, int y, uint32_t ch) {
     if_not_init_return();
 #ifdef TB_OPT_EGC
     int rv;
-    struct tb_cell *cell;
-    size_t nech;
-    if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
-    if (cell->nech > 0) { // append to ech
-        nech = cell->nech + 1;
-        if_err_return(rv, cell_reserve_ech(cell, nech));
+    size_t i, nech;
+    struct cellbuf_ech_t *cell;
+    if_err_return(rv, cellbuf_index(&global.back, x, y, &i));
+    nech = global.back.ech ? global.back.ech[i].nech : 0;
+    if (nech > 0) { // append to ech
+        nech++;
+        if_err_return(rv, cellbuf_reserve_ech(&global.back, i, nech + 1));
+        cell = &global.back.ech[i];
         cell->ech[nech - 1] = ch;
     } else { // make new ech
         nech = 2;
-        if_err_return(rv, cell_reserve_ech(cell, nech));
-        cell->ech[0] = cell->ch;
+        global.back.nclusters++;
+        if_err_return(rv, cellbuf_reserve_ech(&global.back, i, nech + 1));
+        cell = &global.back.ech[i];
+        cell->ech[0] = global.back.ch[i];
         cell->ech[1] = ch;
     }
     cell->ech[nech] = '\0';
     cell->nech = nech;
+    global.back.dirty[y] = 1;
     return TB_OK;
 #else
     (void)x;
@@ -1645,10 +2081,10 @@ int tb_set_input_mode(int mode) {
 
     if (mode & TB_INPUT_MOUSE) {
         bytebuf_puts(&global.out, TB_HARDCAP_ENTER_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        flush_out(0);
     } else {
         bytebuf_puts(&global.out, TB_HARDCAP_EXIT_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        flush_out(0);
     }
 
     global.input_mode = mode;
@@ -1692,6 +2128,11 @@ int tb_get_fds(int *ttyfd, int *resizefd) {
     return TB_OK;
 }
 
+int tb_get_features(void) {
+    if_not_init_return();
+    return global.features;
+}
+
 int tb_print(int x, int y, uintattr_t fg, uintattr_t bg, const char *str) {
     return tb_print_ex(x, y, fg, bg, NULL, str);
 }
@@ -1706,7 +2147,7 @@ int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
     }
     while (*str) {
         str += tb_utf8_char_to_unicode(&uni, str);
-        w = wcwidth((wchar_t)uni);
+        w = tb_wcwidth(uni);
         if (w < 0) {
             w = 1;
         }
@@ -1772,12 +2213,6 @@ int tb_set_func(int fn_type, int (*fn)(struct tb_event *, size_t *)) {
     return TB_ERR;
 }
 
-struct tb_cell *tb_cell_buffer(void) {
-    if (!global.initialized)
-        return NULL;
-    return global.back.cells;
-}
-
 int tb_utf8_char_length(char c) {
     return utf8_length[(unsigned char)c];
 }
@@ -1800,6 +2235,44 @@ int tb_utf8_char_to_unicode(uint32_t *out, const char *c) {
     return (int)len;
 }
 
+static int width_search(const struct width_range_t *table, size_t n,
+    uint32_t ch) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ch < table[mid].first) {
+            hi = mid;
+        } else if (ch > table[mid].last) {
+            lo = mid + 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int tb_wcwidth(uint32_t ch) {
+    if (ch < 0x300) {
+        // Latin, where only control characters stand out
+        if (ch == 0) {
+            return 0;
+        }
+        return ch < 0x20 || (ch >= 0x7f && ch < 0xa0) ? -1 : 1;
+    }
+    // The tables do not overlap, wide code points are looked up first as
+    // they come in long runs of text
+    if (ch >= 0x1100 &&
+        width_search(width_wide, sizeof(width_wide) / sizeof(*width_wide),
+            ch)) {
+        return 2;
+    }
+    if (width_search(width_zero, sizeof(width_zero) / sizeof(*width_zero),
+            ch)) {
+        return 0;
+    }
+    return 1;
+}
+
 int tb_utf8_unicode_to_char(char *out, uint32_t c) {
     int len = 0;
     int first;
@@ -1860,6 +2333,8 @@ const char *tb_strerror(int err) {
             return "Unsupported terminal";
         case TB_ERR_CAP_COLLISION:
             return "Termcaps collision";
+        case TB_ERR_STALE_FRAME:
+            return "Frame rendered against a different screen";
         case TB_ERR_RESIZE_SSCANF:
             return "Terminal width/height not received by sscanf() after "
                    "resize";
@@ -1969,6 +2444,23 @@ static int init_term_caps(void) {
     return load_builtin_caps();
 }
 
+static int init_caps(void) {
+    int rv;
+#ifdef TB_OPT_CAP_CACHE
+    if_ok_return(rv, load_cap_cache());
+#endif
+    if_err_return(rv, init_term_caps());
+    if_err_return(rv, init_cap_trie());
+#ifdef TB_OPT_CAP_CACHE
+    // Only caps read from a terminfo file are cached: built-in caps are a
+    // fallback that must not hide a terminfo file installed later.
+    if (global.terminfo) {
+        save_cap_cache();
+    }
+#endif
+    return TB_OK;
+}
+
 static int init_cap_trie(void) {
     int rv, i;
 
@@ -1989,7 +2481,10 @@ static int init_cap_trie(void) {
         }
     }
 
-    return TB_OK;
+    // The trie is only used to generate the state table
+    rv = cap_dfa_build();
+    cap_trie_deinit(&global.cap_trie);
+    return rv;
 }
 
 static int cap_trie_add(const char *cap, uint16_t key, uint8_t mod) {
@@ -2034,31 +2529,99 @@ static int cap_trie_add(const char *cap, uint16_t key, uint8_t mod) {
     return TB_OK;
 }
 
-static int cap_trie_find(const char *buf, size_t nbuf, struct cap_trie_t **last,
-    size_t *depth) {
-    struct cap_trie_t *next, *node = &global.cap_trie;
-    size_t i, j;
-    *last = node;
-    *depth = 0;
-    for (i = 0; i < nbuf; i++) {
-        char c = buf[i];
-        next = NULL;
+static size_t cap_trie_count(struct cap_trie_t *node) {
+    size_t j, n = 1;
+    for (j = 0; j < node->nchildren; j++) {
+        n += cap_trie_count(&node->children[j]);
+    }
+    return n;
+}
 
-        // Find c in node.children
-        for (j = 0; j < node->nchildren; j++) {
-            if (node->children[j].c == c) {
-                next = &node->children[j];
-                break;
+static int cap_dfa_build(void) {
+    // Number the trie nodes breadth-first: they become the states of a DFA
+    // whose transitions are indexed by byte class. Bytes that appear in no
+    // cap share class 0, which has no transition out of any state.
+    size_t i, j, n, next = 1, nclasses = 1;
+    uint8_t classes[256];
+    struct cap_trie_t **src;
+    uint16_t *trans;
+
+    n = cap_trie_count(&global.cap_trie);
+    if (n > UINT16_MAX) {
+        return TB_ERR;
+    }
+    src = tb_malloc(sizeof(*src) * n);
+    if (!src) {
+        return TB_ERR_MEM;
+    }
+    src[0] = &global.cap_trie;
+    memset(classes, 0, sizeof(classes));
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < src[i]->nchildren; j++) {
+            struct cap_trie_t *child = &src[i]->children[j];
+            if (!classes[(unsigned char)child->c]) {
+                classes[(unsigned char)child->c] = nclasses++;
             }
+            src[next++] = child;
         }
-        if (!next) {
+    }
+
+    global.ncap_dfa = cap_dfa_size(n, nclasses);
+    global.cap_dfa = tb_malloc(global.ncap_dfa);
+    if (!global.cap_dfa) {
+        tb_free(src);
+        return TB_ERR_MEM;
+    }
+    memset(global.cap_dfa, 0, global.ncap_dfa);
+    memcpy(global.cap_dfa, classes, sizeof(classes));
+    cap_dfa_attach(global.cap_dfa, n, nclasses);
+
+    struct cap_state_t *states = (struct cap_state_t *)global.cap_states;
+    trans = (uint16_t *)global.cap_trans;
+    for (next = 1, i = 0; i < n; i++) {
+        states[i].key = src[i]->key;
+        states[i].mod = src[i]->mod;
+        states[i].flags = (src[i]->is_leaf ? CAP_STATE_LEAF : 0) |
+                          (src[i]->nchildren > 0 ? CAP_STATE_BRANCH : 0);
+        for (j = 0; j < src[i]->nchildren; j++) {
+            trans[i * nclasses +
+                  classes[(unsigned char)src[i]->children[j].c]] = next++;
+        }
+    }
+
+    tb_free(src);
+    return TB_OK;
+}
+
+static size_t cap_dfa_size(size_t nstates, size_t nclasses) {
+    // Byte classes, then states, then the transition table
+    return 256 + nstates * sizeof(struct cap_state_t) +
+           nstates * nclasses * sizeof(uint16_t);
+}
+
+static void cap_dfa_attach(char *dfa, size_t nstates, size_t nclasses) {
+    global.cap_classes = (const uint8_t *)dfa;
+    global.cap_states = (const struct cap_state_t *)(dfa + 256);
+    global.cap_trans = (const uint16_t *)(global.cap_states + nstates);
+    global.ncap_states = nstates;
+    global.ncap_classes = nclasses;
+}
+
+static int cap_dfa_find(const char *buf, size_t nbuf,
+    const struct cap_state_t **last, size_t *depth) {
+    size_t i, state = 0;
+    *last = &global.cap_states[0];
+    *depth = 0;
+    for (i = 0; i < nbuf; i++) {
+        state = global.cap_trans[state * global.ncap_classes +
+                                 global.cap_classes[(unsigned char)buf[i]]];
+        if (state == 0) {
             // Not found
             return TB_OK;
         }
-        node = next;
-        *last = node;
+        *last = &global.cap_states[state];
         *depth += 1;
-        if (node->is_leaf && node->nchildren < 1) {
+        if ((*last)->flags == CAP_STATE_LEAF) {
             break;
         }
     }
@@ -2112,82 +2675,95 @@ static int send_clear(void) {
         bytebuf_puts(&global.out, global.caps[TB_CAP_CLEAR_SCREEN]));
 
     if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+    if_err_return(rv, flush_out(0));
 
     global.last_x = -1;
     global.last_y = -1;
+    global.front_gen++;
 
     return TB_OK;
 }
 
 static int update_term_size(void) {
-    int rv, ioctl_errno;
-
-    if (global.ttyfd < 0) {
-        return TB_OK;
-    }
+#ifndef TB_DEFAULT_WIDTH
+#define TB_DEFAULT_WIDTH 80
+#endif
+#ifndef TB_DEFAULT_HEIGHT
+#define TB_DEFAULT_HEIGHT 24
+#endif
 
     struct winsize sz;
     memset(&sz, 0, sizeof(sz));
 
     // Try ioctl TIOCGWINSZ
-    if (ioctl(global.ttyfd, TIOCGWINSZ, &sz) == 0) {
+    if (global.ttyfd >= 0 && ioctl(global.ttyfd, TIOCGWINSZ, &sz) == 0 &&
+        sz.ws_col > 0 && sz.ws_row > 0)
+    {
         global.width = sz.ws_col;
         global.height = sz.ws_row;
         return TB_OK;
     }
-    ioctl_errno = errno;
-
-    // Try >cursor(9999,9999), >u7, <u6
-    if_ok_return(rv, update_term_size_via_esc());
 
-    global.last_errno = ioctl_errno;
-    return TB_ERR_RESIZE_IOCTL;
+    // Keep drawing with the last known size (or a default one) rather than
+    // waiting for the terminal: >cursor(9999,9999), >u7 is sent by
+    // send_probe() and <u6 is picked up by extract_probe_reply()
+    if (global.width < 1 || global.height < 1) {
+        global.width = TB_DEFAULT_WIDTH;
+        global.height = TB_DEFAULT_HEIGHT;
+    }
+    global.probe_cpr = 1;
+    return TB_OK;
 }
 
-static int update_term_size_via_esc(void) {
-#ifndef TB_RESIZE_FALLBACK_MS
-#define TB_RESIZE_FALLBACK_MS 1000
-#endif
+static int send_probe(void) {
+    int rv, sent = 0;
 
-    char *move_and_report = "\x1b[9999;9999H\x1b[6n";
-    ssize_t write_rv =
-        write(global.wfd, move_and_report, strlen(move_and_report));
-    if (write_rv != (ssize_t)strlen(move_and_report)) {
-        return TB_ERR_RESIZE_WRITE;
+    if (global.rfd < 0 || global.wfd < 0) {
+        global.probe_cpr = 0;
+        return TB_OK;
     }
 
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(global.rfd, &fds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = TB_RESIZE_FALLBACK_MS * 1000;
-
-    int select_rv = select(global.rfd + 1, &fds, NULL, NULL, &timeout);
-
-    if (select_rv != 1) {
-        global.last_errno = errno;
-        return TB_ERR_RESIZE_POLL;
+    // Ask everything in a single round trip. DA1 goes last: every terminal
+    // answers it, so its reply tells the other queries went unanswered.
+    if (global.probe_cpr) {
+        send_literal(rv, TB_HARDCAP_QUERY_SIZE);
+        global.last_x = -1;
+        global.last_y = -1;
+        sent = 1;
     }
-
-    char buf[TB_OPT_READ_BUF];
-    ssize_t read_rv = read(global.rfd, buf, sizeof(buf) - 1);
-    if (read_rv < 1) {
-        global.last_errno = errno;
-        return TB_ERR_RESIZE_READ;
+    if (!global.probe_sent) {
+        send_literal(rv, TB_HARDCAP_QUERY_SYNC);
+        send_literal(rv, TB_HARDCAP_QUERY_RGB);
+        global.last_fg = ~global.fg;
+        global.last_bg = ~global.bg;
+        global.probe_sent = 1;
+        global.probe_rqss = 1;
+        sent = 1;
     }
-    buf[read_rv] = '\0';
-
-    int rw, rh;
-    if (sscanf(buf, "\x1b[%d;%dR", &rh, &rw) != 2) {
-        return TB_ERR_RESIZE_SSCANF;
+    if (sent) {
+        send_literal(rv, TB_HARDCAP_QUERY_DA1);
+        global.probe_pending++;
+        global.probe_deadline = monotonic_ms() + TB_OPT_PROBE_TIMEOUT_MS;
     }
+    return flush_out(0);
+}
 
-    global.width = rw;
-    global.height = rh;
-    return TB_OK;
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int probe_expired(void) {
+    // A terminal that never answers must not hold input back: past the
+    // deadline, the queries are given up on
+    if (!global.probe_pending || monotonic_ms() < global.probe_deadline) {
+        return 0;
+    }
+    global.probe_pending = 0;
+    global.probe_cpr = 0;
+    global.probe_rqss = 0;
+    return 1;
 }
 
 static int init_cellbuf(void) {
@@ -2200,6 +2776,9 @@ static int init_cellbuf(void) {
 }
 
 static int tb_deinit(void) {
+#ifdef TB_OPT_WRITER_THREAD
+    writer_stop();
+#endif
     if (global.caps[0] != NULL && global.wfd >= 0) {
         bytebuf_puts(&global.out, global.caps[TB_CAP_SHOW_CURSOR]);
         bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]);
@@ -2229,11 +2808,21 @@ static int tb_deinit(void) {
     cellbuf_free(&global.front);
     bytebuf_free(&global.in);
     bytebuf_free(&global.out);
+#ifdef TB_OPT_WRITER_THREAD
+    cellbuf_free(&global.unsent);
+    bytebuf_free(&global.pending);
+    bytebuf_free(&global.writing);
+#endif
 
     if (global.terminfo)
         tb_free(global.terminfo);
 
     cap_trie_deinit(&global.cap_trie);
+    if (global.cap_cache) {
+        munmap(global.cap_cache, global.ncap_cache);
+    } else if (global.cap_dfa) {
+        tb_free(global.cap_dfa);
+    }
 
     tb_reset();
     return TB_OK;
@@ -2343,6 +2932,8 @@ static int read_terminfo_path(const char *path) {
 
     global.terminfo = data;
     global.nterminfo = fsize;
+    global.terminfo_st = st;
+    snprintf(global.terminfo_path, sizeof(global.terminfo_path), "%s", path);
 
     fclose(fp);
     return TB_OK;
@@ -2455,35 +3046,240 @@ static const char *get_terminfo_string(int16_t str_offsets_pos,
         const char *)(global.terminfo + (int)str_table_pos + (int)*str_offset);
 }
 
-static int wait_event(struct tb_event *event, int timeout) {
+#ifdef TB_OPT_CAP_CACHE
+static int get_cap_cache_path(char *path, size_t npath) {
     int rv;
-    char buf[TB_OPT_READ_BUF];
-
-    memset(event, 0, sizeof(*event));
-    if_ok_return(rv, extract_event(event));
-
-    fd_set fds;
-    struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
+    const char *term = getenv("TERM");
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
 
-    do {
-        FD_ZERO(&fds);
-        FD_SET(global.rfd, &fds);
-        FD_SET(global.resize_pipefd[0], &fds);
+    // TERM ends up in a file name, keep it in the cache directory
+    if (!term || *term == '\0' || strchr(term, '/')) {
+        return TB_ERR;
+    }
+    if (cache && *cache != '\0') {
+        snprintf_or_return(rv, path, npath, "%s/termbox-%s", cache, term);
+    } else if (home) {
+        snprintf_or_return(rv, path, npath, "%s/.cache/termbox-%s", home,
+            term);
+    } else {
+        return TB_ERR;
+    }
+    return TB_OK;
+}
 
-        int maxfd = global.resize_pipefd[0] > global.rfd
-                        ? global.resize_pipefd[0]
-                        : global.rfd;
+static uint64_t get_cap_cache_env_hash(void) {
+    // FNV-1a over everything load_terminfo() looks at
+    const char *vars[] = {"TERM", "TERMINFO", "HOME", "TERMINFO_DIRS"};
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        const char *val = getenv(vars[i]);
+        do {
+            hash = (hash ^ (unsigned char)(val ? *val : '\0')) *
+                   0x100000001b3ULL;
+        } while (val && *val++ != '\0');
+    }
+    return hash;
+}
 
-        int select_rv =
-            select(maxfd + 1, &fds, NULL, NULL, (timeout < 0) ? NULL : &tv);
+static int load_cap_cache(void) {
+    int rv, fd;
+    char path[PATH_MAX];
+    struct stat st, tst;
+    struct cap_cache_t *hdr;
+    char *dfa;
+    const uint16_t *trans;
+    const char *strs;
+    size_t i;
+    void *map;
+
+    if_err_return(rv, get_cap_cache_path(path, sizeof(path)));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return TB_ERR;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return TB_ERR;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return TB_ERR;
+    }
 
-        if (select_rv < 0) {
-            // Let EINTR/EAGAIN bubble up
-            global.last_errno = errno;
-            return TB_ERR_POLL;
-        } else if (select_rv == 0) {
+    // Reject caches of another version, environment or terminfo file, and
+    // anything that would let a lookup go out of bounds
+    hdr = map;
+    dfa = (char *)(hdr + 1);
+    rv = TB_ERR;
+    do {
+        if (memcmp(hdr->magic, TB_CAP_CACHE_MAGIC,
+                sizeof(TB_CAP_CACHE_MAGIC)) != 0 ||
+            hdr->version != TB_CAP_CACHE_VERSION ||
+            hdr->ncaps != TB_CAP__COUNT ||
+            hdr->env_hash != get_cap_cache_env_hash() || hdr->nstates < 1 ||
+            hdr->nstates > UINT16_MAX + 1 || hdr->nclasses < 1 ||
+            hdr->nclasses > 256 || hdr->nstrs < 1 ||
+            (size_t)st.st_size != sizeof(*hdr) +
+                                      cap_dfa_size(hdr->nstates,
+                                          hdr->nclasses) +
+                                      hdr->nstrs ||
+            hdr->terminfo_path[sizeof(hdr->terminfo_path) - 1] != '\0')
+        {
+            break;
+        }
+        if (stat(hdr->terminfo_path, &tst) != 0 ||
+            (int64_t)tst.st_mtime != hdr->terminfo_mtime ||
+            (int64_t)tst.st_size != hdr->terminfo_size)
+        {
+            break;
+        }
+        strs = dfa + cap_dfa_size(hdr->nstates, hdr->nclasses);
+        if (strs[hdr->nstrs - 1] != '\0') {
+            break;
+        }
+        for (i = 0; i < TB_CAP__COUNT; i++) {
+            if (hdr->cap_offsets[i] >= hdr->nstrs) {
+                break;
+            }
+        }
+        if (i < TB_CAP__COUNT) {
+            break;
+        }
+        for (i = 0; i < 256; i++) {
+            if ((uint8_t)dfa[i] >= hdr->nclasses) {
+                break;
+            }
+        }
+        if (i < 256) {
+            break;
+        }
+        trans = (const uint16_t *)(dfa + 256 +
+                                   hdr->nstates * sizeof(struct cap_state_t));
+        for (i = 0; i < hdr->nstates * hdr->nclasses; i++) {
+            if (trans[i] >= hdr->nstates) {
+                break;
+            }
+        }
+        if (i < hdr->nstates * hdr->nclasses) {
+            break;
+        }
+        rv = TB_OK;
+    } while (0);
+
+    if (rv != TB_OK) {
+        munmap(map, st.st_size);
+        return rv;
+    }
+
+    global.cap_cache = map;
+    global.ncap_cache = st.st_size;
+    cap_dfa_attach(dfa, hdr->nstates, hdr->nclasses);
+    for (i = 0; i < TB_CAP__COUNT; i++) {
+        global.caps[i] = strs + hdr->cap_offsets[i];
+    }
+    return TB_OK;
+}
+
+static int save_cap_cache(void) {
+    int rv, ok;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct cap_cache_t hdr;
+    size_t i, len;
+    FILE *fp;
+
+    if_err_return(rv, get_cap_cache_path(path, sizeof(path)));
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CAP_CACHE_MAGIC, sizeof(TB_CAP_CACHE_MAGIC));
+    hdr.version = TB_CAP_CACHE_VERSION;
+    hdr.ncaps = TB_CAP__COUNT;
+    hdr.env_hash = get_cap_cache_env_hash();
+    hdr.terminfo_mtime = global.terminfo_st.st_mtime;
+    hdr.terminfo_size = global.terminfo_st.st_size;
+    snprintf_or_return(rv, hdr.terminfo_path, sizeof(hdr.terminfo_path), "%s",
+        global.terminfo_path);
+    hdr.nstates = global.ncap_states;
+    hdr.nclasses = global.ncap_classes;
+    for (i = 0; i < TB_CAP__COUNT; i++) {
+        hdr.cap_offsets[i] = hdr.nstrs;
+        hdr.nstrs += strlen(global.caps[i]) + 1;
+    }
+
+    // Create the cache directory if needed
+    snprintf_or_return(rv, tmp, sizeof(tmp), "%s", path);
+    *strrchr(tmp, '/') = '\0';
+    mkdir(tmp, 0700);
+
+    // Write a temporary file renamed over the cache, so that concurrent
+    // instances never map a partial cache
+    snprintf_or_return(rv, tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        return TB_ERR;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+         fwrite(global.cap_dfa, 1, global.ncap_dfa, fp) == global.ncap_dfa;
+    for (i = 0; ok && i < TB_CAP__COUNT; i++) {
+        len = strlen(global.caps[i]) + 1;
+        ok = fwrite(global.caps[i], 1, len, fp) == len;
+    }
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return TB_ERR;
+    }
+    return TB_OK;
+}
+#endif
+
+static int wait_event(struct tb_event *event, int timeout) {
+    int rv;
+
+    memset(event, 0, sizeof(*event));
+    if_ok_return(rv, extract_events(event));
+
+    fd_set fds;
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
+
+    do {
+        FD_ZERO(&fds);
+        FD_SET(global.rfd, &fds);
+        FD_SET(global.resize_pipefd[0], &fds);
+
+        int maxfd = global.resize_pipefd[0] > global.rfd
+                        ? global.resize_pipefd[0]
+                        : global.rfd;
+
+        // Input held back as the start of an answer to the probe is decoded
+        // as keys once the probe times out
+        struct timeval *tvp = (timeout < 0) ? NULL : &tv, probe_tv;
+        if (global.probe_pending && global.in.len > 0) {
+            int64_t left = global.probe_deadline - monotonic_ms();
+            left = left > 0 ? left : 0;
+            probe_tv.tv_sec = left / 1000;
+            probe_tv.tv_usec = (left % 1000) * 1000;
+            if (!tvp || timercmp(&probe_tv, tvp, <)) {
+                tvp = &probe_tv;
+            }
+        }
+
+        int select_rv = select(maxfd + 1, &fds, NULL, NULL, tvp);
+
+        if (select_rv < 0) {
+            // Let EINTR/EAGAIN bubble up
+            global.last_errno = errno;
+            return TB_ERR_POLL;
+        } else if (select_rv == 0) {
+            if (tvp == &probe_tv && probe_expired()) {
+                memset(event, 0, sizeof(*event));
+                if_ok_return(rv, extract_events(event));
+                if (timeout == -1) {
+                    continue;
+                }
+            }
             return TB_ERR_NO_EVENT;
         }
 
@@ -2491,13 +3287,7 @@ static int wait_event(struct tb_event *event, int timeout) {
         int resize_has_events = (FD_ISSET(global.resize_pipefd[0], &fds));
 
         if (tty_has_events) {
-            ssize_t read_rv = read(global.rfd, buf, sizeof(buf));
-            if (read_rv < 0) {
-                global.last_errno = errno;
-                return TB_ERR_READ;
-            } else if (read_rv > 0) {
-                bytebuf_nputs(&global.in, buf, read_rv);
-            }
+            if_err_return(rv, read_input());
         }
 
         if (resize_has_events) {
@@ -2505,6 +3295,7 @@ static int wait_event(struct tb_event *event, int timeout) {
             read(global.resize_pipefd[0], &ignore, sizeof(ignore));
             // TODO Harden against errors encountered mid-resize
             if_err_return(rv, update_term_size());
+            if_err_return(rv, send_probe());
             if_err_return(rv, resize_cellbufs());
             event->type = TB_EVENT_RESIZE;
             event->w = global.width;
@@ -2513,16 +3304,80 @@ static int wait_event(struct tb_event *event, int timeout) {
         }
 
         memset(event, 0, sizeof(*event));
-        if_ok_return(rv, extract_event(event));
+        if_ok_return(rv, extract_events(event));
     } while (timeout == -1);
 
     return rv;
 }
 
+static int read_input(void) {
+    int rv, npending = 0;
+    ssize_t read_rv;
+
+    // Read everything the tty has queued at once, so that bursts of keys
+    // are decoded together instead of TB_OPT_READ_BUF bytes per event
+    if (ioctl(global.rfd, FIONREAD, &npending) != 0 ||
+        npending < TB_OPT_READ_BUF)
+    {
+        npending = TB_OPT_READ_BUF;
+    }
+    if_err_return(rv,
+        bytebuf_reserve(&global.in, global.in.len + (size_t)npending + 1));
+
+    read_rv = read(global.rfd, global.in.buf + global.in.len, npending);
+    if (read_rv < 0) {
+        global.last_errno = errno;
+        return TB_ERR_READ;
+    }
+    global.in.len += read_rv;
+    global.in.buf[global.in.len] = '\0';
+    return TB_OK;
+}
+
+static int extract_events(struct tb_event *event) {
+    int rv = TB_ERR;
+    struct tb_event *queued;
+
+    // Decode all complete events of the input buffer in one pass, then hand
+    // them out in order
+    while (global.nevents < TB_OPT_EVENT_QUEUE) {
+        queued = &global.events[(global.first_event + global.nevents) %
+                                TB_OPT_EVENT_QUEUE];
+        memset(queued, 0, sizeof(*queued));
+        if ((rv = extract_event(queued)) != TB_OK) {
+            break;
+        }
+        global.nevents++;
+    }
+
+    if (global.nevents == 0) {
+        return rv;
+    }
+    *event = global.events[global.first_event];
+    global.first_event = (global.first_event + 1) % TB_OPT_EVENT_QUEUE;
+    global.nevents--;
+    return TB_OK;
+}
+
 static int extract_event(struct tb_event *event) {
     int rv;
     struct bytebuf_t *in = &global.in;
 
+    // Answers to send_probe() are consumed before anything else, only a new
+    // size is reported. They all come before the answer to the last DA1.
+    probe_expired();
+    while (global.probe_pending && in->len > 1 && in->buf[0] == '\x1b')
+    {
+        rv = extract_probe_reply(event);
+        if (rv == TB_ERR_NEED_MORE ||
+            (rv == TB_OK && event->type == TB_EVENT_RESIZE))
+        {
+            return rv;
+        } else if (rv != TB_OK) {
+            break;
+        }
+    }
+
     if (in->len == 0) {
         return TB_ERR;
     }
@@ -2574,6 +3429,95 @@ static int extract_event(struct tb_event *event) {
     return TB_ERR;
 }
 
+static int extract_probe_reply(struct tb_event *event) {
+    int rv;
+    struct bytebuf_t *in = &global.in;
+    int params[2] = {0, 0};
+    int nparams = 0, priv = 0, dollar = 0;
+    size_t i = 2;
+    char final, reply[64];
+
+    if (in->buf[1] == 'P' && global.probe_rqss) {
+        // DECRQSS answer: \x1bP 1 $r <sgr> m \x1b\ if the query was understood
+        while (i + 1 < in->len &&
+               !(in->buf[i] == '\x1b' && in->buf[i + 1] == '\\'))
+        {
+            i++;
+        }
+        if (i + 1 >= in->len) {
+            return in->len < sizeof(reply) ? TB_ERR_NEED_MORE : TB_ERR;
+        }
+        snprintf(reply, sizeof(reply), "%.*s", (int)(i - 2), &in->buf[2]);
+        if (reply[0] == '1' &&
+            (strstr(reply, "2:1:2:3") || strstr(reply, "2;1;2;3")))
+        {
+            global.features |= TB_FEATURE_TRUECOLOR;
+        }
+        global.probe_rqss = 0;
+        bytebuf_shift(in, i + 2);
+        return TB_OK;
+    } else if (in->buf[1] != '[') {
+        return TB_ERR;
+    }
+
+    // CSI answers: \x1b [ ? Ps ; Ps $ final
+    if (i < in->len && in->buf[i] == '?') {
+        priv = 1;
+        i++;
+    }
+    for (; i < in->len && ((in->buf[i] >= '0' && in->buf[i] <= '9') ||
+                              in->buf[i] == ';');
+         i++)
+    {
+        if (in->buf[i] == ';') {
+            nparams++;
+        } else if (nparams < 2 && params[nparams] < 100000) {
+            params[nparams] = params[nparams] * 10 + (in->buf[i] - '0');
+        }
+    }
+    if (i < in->len && in->buf[i] == '$') {
+        dollar = 1;
+        i++;
+    }
+    if (i >= in->len) {
+        return TB_ERR_NEED_MORE;
+    }
+    final = in->buf[i++];
+
+    if (final == 'R' && global.probe_cpr && !priv && !dollar && nparams == 1) {
+        // Cursor position report, the cursor being in the bottom right corner
+        global.probe_cpr = 0;
+        if (params[0] > 0 && params[1] > 0 &&
+            (params[1] != global.width || params[0] != global.height))
+        {
+            global.width = params[1];
+            global.height = params[0];
+            if_err_return(rv, resize_cellbufs());
+            event->type = TB_EVENT_RESIZE;
+            event->w = global.width;
+            event->h = global.height;
+        }
+    } else if (final == 'y' && priv && dollar && params[0] == 2026) {
+        // DECRQM answer: 1 (set) or 2 (reset) if the mode is supported
+        if (params[1] == 1 || params[1] == 2) {
+            global.features |= TB_FEATURE_SYNC;
+        }
+    } else if (final == 'c' && priv && !dollar) {
+        // DA1 answer: the queries sent before it that are still unanswered
+        // never will be, so that a key looking like their answer (Shift+F3
+        // for a position report) is decoded as a key
+        if (--global.probe_pending == 0) {
+            global.probe_cpr = 0;
+            global.probe_rqss = 0;
+        }
+    } else {
+        return TB_ERR;
+    }
+
+    bytebuf_shift(in, i);
+    return TB_OK;
+}
+
 static int extract_esc(struct tb_event *event) {
     int rv;
     if_ok_or_need_more_return(rv, extract_esc_user(event, 0));
@@ -2607,11 +3551,11 @@ static int extract_esc_user(struct tb_event *event, int is_post) {
 static int extract_esc_cap(struct tb_event *event) {
     int rv;
     struct bytebuf_t *in = &global.in;
-    struct cap_trie_t *node;
+    const struct cap_state_t *node;
     size_t depth;
 
-    if_err_return(rv, cap_trie_find(in->buf, in->len, &node, &depth));
-    if (node->is_leaf) {
+    if_err_return(rv, cap_dfa_find(in->buf, in->len, &node, &depth));
+    if (node->flags & CAP_STATE_LEAF) {
         // Found a leaf node
         event->type = TB_EVENT_KEY;
         event->ch = 0;
@@ -2619,7 +3563,7 @@ static int extract_esc_cap(struct tb_event *event) {
         event->mod = node->mod;
         bytebuf_shift(in, depth);
         return TB_OK;
-    } else if (node->nchildren > 0 && in->len <= depth) {
+    } else if ((node->flags & CAP_STATE_BRANCH) && in->len <= depth) {
         // Found a branch node (not enough input)
         return TB_ERR_NEED_MORE;
     }
@@ -2816,6 +3760,7 @@ static int resize_cellbufs(void) {
     if_err_return(rv,
         cellbuf_resize(&global.front, global.width, global.height));
     if_err_return(rv, cellbuf_clear(&global.front));
+    memset(global.back.dirty, 1, global.back.height);
     if_err_return(rv, send_clear());
     return TB_OK;
 }
@@ -3052,6 +3997,221 @@ static int send_cluster(int x, int y, uint32_t *ch, size_t nch) {
     return TB_OK;
 }
 
+static int send_frame(struct cellbuf_t *front, int clean) {
+    // Append to global.out what turns front into the back buffer, updating
+    // front along the way. Dirty rows of the back buffer are reset if clean.
+    int rv;
+
+    global.last_x = -1;
+    global.last_y = -1;
+    global.present_cells = 0;
+
+    if (global.features & TB_FEATURE_SYNC) {
+        // Have the terminal paint the frame at once
+        send_literal(rv, TB_HARDCAP_BEGIN_SYNC);
+    }
+
+    struct cellbuf_t *back = &global.back;
+    int x, y, i;
+    size_t cell, row;
+    for (y = 0; y < front->height; y++) {
+        // Rows left alone since the last call already match the terminal
+        if (!back->dirty[y]) {
+            continue;
+        }
+        if (clean) {
+            back->dirty[y] = 0;
+        }
+        row = (size_t)y * front->width;
+        for (x = 0; x < front->width;) {
+            // Jump to the next cell that changed or may be wide
+            cell = cellbuf_next(back, front, row + x, row + front->width);
+            x = cell - row;
+            if (x >= front->width) {
+                break;
+            }
+
+            int w;
+            {
+#ifdef TB_OPT_EGC
+                if (back->ech && back->ech[cell].nech > 0)
+                    w = cluster_width(back->ech[cell].ech,
+                        back->ech[cell].nech);
+                else
+#endif
+                    w = tb_wcwidth(back->ch[cell]);
+            }
+            if (w < 1) {
+                w = 1;
+            }
+
+            if (cellbuf_cmp(back, front, cell) != 0) {
+                if_err_return(rv, cellbuf_copy(front, back, cell));
+                global.present_cells++;
+
+                send_attr(back->fg[cell], back->bg[cell]);
+                if (w > 1 && x >= front->width - (w - 1)) {
+                    for (i = x; i < front->width; i++) {
+                        send_char(i, y, ' ');
+                    }
+                } else {
+                    {
+#ifdef TB_OPT_EGC
+                        if (back->ech && back->ech[cell].nech > 0)
+                            send_cluster(x, y, back->ech[cell].ech,
+                                back->ech[cell].nech);
+                        else
+#endif
+                            send_char(x, y, back->ch[cell]);
+                    }
+                    for (i = 1; i < w; i++) {
+                        if_err_return(rv, cellbuf_set(front, cell + i, NULL, 1,
+                                              back->fg[cell], back->bg[cell]));
+                    }
+                }
+            }
+            x += w;
+        }
+    }
+
+    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
+    if (global.features & TB_FEATURE_SYNC) {
+        send_literal(rv, TB_HARDCAP_END_SYNC);
+    }
+    return TB_OK;
+}
+
+static int flush_out(int droppable) {
+    // Write global.out, or hand it over to the writer thread. Only a frame
+    // that nothing else was appended to may be dropped by the writer.
+#ifdef TB_OPT_WRITER_THREAD
+    if (global.writer_started) {
+        return writer_queue(&global.out, droppable);
+    }
+#endif
+    (void)droppable;
+    return bytebuf_flush(&global.out, global.wfd);
+}
+
+#ifdef TB_OPT_WRITER_THREAD
+static int writer_start(void) {
+    if (pthread_mutex_init(&global.writer_mutex, NULL) != 0) {
+        return TB_ERR;
+    }
+    if (pthread_cond_init(&global.writer_cond, NULL) != 0) {
+        pthread_mutex_destroy(&global.writer_mutex);
+        return TB_ERR;
+    }
+    if ((global.last_errno = pthread_create(&global.writer, NULL, writer_run,
+             NULL)) != 0) {
+        pthread_cond_destroy(&global.writer_cond);
+        pthread_mutex_destroy(&global.writer_mutex);
+        return TB_ERR;
+    }
+    global.writer_started = 1;
+    return TB_OK;
+}
+
+static int writer_stop(void) {
+    // Let the writer finish what was handed over, then join it
+    if (!global.writer_started) {
+        return TB_OK;
+    }
+    pthread_mutex_lock(&global.writer_mutex);
+    global.writer_quit = 1;
+    pthread_cond_signal(&global.writer_cond);
+    pthread_mutex_unlock(&global.writer_mutex);
+    pthread_join(global.writer, NULL);
+    pthread_cond_destroy(&global.writer_cond);
+    pthread_mutex_destroy(&global.writer_mutex);
+    global.writer_started = 0;
+    return TB_OK;
+}
+
+static void *writer_run(void *arg) {
+    (void)arg;
+    struct bytebuf_t b;
+
+    pthread_mutex_lock(&global.writer_mutex);
+    for (;;) {
+        while (global.pending.len == 0 && !global.writer_quit) {
+            pthread_cond_wait(&global.writer_cond, &global.writer_mutex);
+        }
+        if (global.pending.len == 0) {
+            break;
+        }
+        b = global.writing;
+        global.writing = global.pending;
+        global.pending = b;
+        pthread_mutex_unlock(&global.writer_mutex);
+
+        int rv = bytebuf_flush(&global.writing, global.wfd);
+        global.writing.len = 0;
+
+        pthread_mutex_lock(&global.writer_mutex);
+        if (rv != TB_OK) {
+            global.writer_failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&global.writer_mutex);
+    return NULL;
+}
+
+static int writer_supersede(int drop) {
+    // Before a frame is diffed against the front buffer: if drop is set and
+    // the pending frame was not picked up, discard it and go back to the
+    // screen it applied to. Otherwise remember the screen the next frame
+    // applies to, should it be dropped in turn.
+    int rv, dropped;
+
+    if (!global.writer_started) {
+        return TB_OK;
+    }
+    pthread_mutex_lock(&global.writer_mutex);
+    dropped = drop && global.pending.len > 0 && global.pending_droppable;
+    if (dropped) {
+        global.pending.len = 0;
+    }
+    pthread_mutex_unlock(&global.writer_mutex);
+
+    if (dropped) {
+        if_err_return(rv, cellbuf_assign(&global.front, &global.unsent));
+        memset(global.back.dirty, 1, global.back.height);
+        global.last_fg = global.unsent_fg;
+        global.last_bg = global.unsent_bg;
+    } else {
+        if_err_return(rv, cellbuf_assign(&global.unsent, &global.front));
+        global.unsent_fg = global.last_fg;
+        global.unsent_bg = global.last_bg;
+    }
+    return TB_OK;
+}
+
+static int writer_queue(struct bytebuf_t *b, int droppable) {
+    // Hand the contents of b over to the writer, after the pending bytes if
+    // it did not pick them up yet
+    int rv = TB_OK;
+    struct bytebuf_t tmp;
+
+    pthread_mutex_lock(&global.writer_mutex);
+    if (global.writer_failed) {
+        rv = TB_ERR;
+    } else if (global.pending.len == 0) {
+        tmp = global.pending;
+        global.pending = *b;
+        *b = tmp;
+        global.pending_droppable = droppable;
+    } else {
+        rv = bytebuf_nputs(&global.pending, b->buf, b->len);
+        global.pending_droppable = 0;
+    }
+    b->len = 0;
+    pthread_cond_signal(&global.writer_cond);
+    pthread_mutex_unlock(&global.writer_mutex);
+    return rv;
+}
+#endif
+
 static int convert_num(uint32_t num, char *buf) {
     int i, l = 0;
     char ch;
@@ -3068,119 +4228,239 @@ static int convert_num(uint32_t num, char *buf) {
     return l;
 }
 
-static int cell_cmp(struct tb_cell *a, struct tb_cell *b) {
-    if (a->ch != b->ch || a->fg != b->fg || a->bg != b->bg) {
-        return 1;
+static size_t diff_index(const void *a, const void *b, size_t n, size_t size) {
+    // Index of the first of n elements of the given size that differ
+    const unsigned char *ca = a, *cb = b;
+    size_t i = 0, nbytes = n * size;
+#ifdef __SSE2__
+    for (; i + 16 <= nbytes; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ca + i)),
+            _mm_loadu_si128((const __m128i *)(cb + i)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+        if (mask != 0xffff) {
+            return (i + __builtin_ctz(~mask)) / size;
+        }
+    }
+#endif
+    for (; i < nbytes; i++) {
+        if (ca[i] != cb[i]) {
+            return i / size;
+        }
+    }
+    return n;
+}
+
+static int cluster_width(const uint32_t *ech, size_t nech) {
+    // Columns taken by a grapheme cluster, its marks adding nothing to the
+    // base character unless they are wide themselves
+    int w = 0, cw;
+    size_t i;
+    for (i = 0; i < nech && ech[i]; i++) {
+        cw = tb_wcwidth(ech[i]);
+        if (cw > 0) {
+            w += cw;
+        }
+    }
+    return w;
+}
+
+static size_t wide_index(const uint32_t *ch, size_t n) {
+    // Index of the first code point that may be wider than 1 column, i.e.
+    // the first at or above U+1100 (Hangul Jamo, the first wide block)
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i narrow = _mm_set1_epi32(0x10ff);
+    for (; i + 4 <= n; i += 4) {
+        __m128i gt = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(ch + i)),
+            narrow);
+        if (_mm_movemask_epi8(gt) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (ch[i] >= 0x1100) {
+            return i;
+        }
+    }
+    return n;
+}
+
+static int cellbuf_init(struct cellbuf_t *c, int w, int h) {
+    size_t n = (size_t)w * h;
+    memset(c, 0, sizeof(*c));
+    c->ch = tb_malloc(sizeof(*c->ch) * n);
+    c->fg = tb_malloc(sizeof(*c->fg) * n);
+    c->bg = tb_malloc(sizeof(*c->bg) * n);
+    c->dirty = tb_malloc(h);
+    if (!c->ch || !c->fg || !c->bg || !c->dirty) {
+        cellbuf_free(c);
+        return TB_ERR_MEM;
     }
+    memset(c->dirty, 1, h);
+    memset(c->ch, 0, sizeof(*c->ch) * n);
+    memset(c->fg, 0, sizeof(*c->fg) * n);
+    memset(c->bg, 0, sizeof(*c->bg) * n);
+    c->width = w;
+    c->height = h;
+    return TB_OK;
+}
+
+static int cellbuf_free(struct cellbuf_t *c) {
 #ifdef TB_OPT_EGC
-    if (a->nech != b->nech) {
-        return 1;
-    } else if (a->nech > 0) { // a->nech == b->nech
-        return memcmp(a->ech, b->ech, a->nech);
+    if (c->ech) {
+        size_t i;
+        for (i = 0; i < (size_t)c->width * c->height; i++) {
+            if (c->ech[i].ech) {
+                tb_free(c->ech[i].ech);
+            }
+        }
+        tb_free(c->ech);
     }
 #endif
-    return 0;
+    if (c->ch) {
+        tb_free(c->ch);
+    }
+    if (c->fg) {
+        tb_free(c->fg);
+    }
+    if (c->bg) {
+        tb_free(c->bg);
+    }
+    if (c->dirty) {
+        tb_free(c->dirty);
+    }
+    memset(c, 0, sizeof(*c));
+    return TB_OK;
 }
 
-static int cell_copy(struct tb_cell *dst, struct tb_cell *src) {
+static int cellbuf_clear(struct cellbuf_t *c) {
+    size_t i, n = (size_t)c->width * c->height;
+    for (i = 0; i < n; i++) {
+        c->ch[i] = ' ';
+        c->fg[i] = global.fg;
+        c->bg[i] = global.bg;
+    }
+    memset(c->dirty, 1, c->height);
 #ifdef TB_OPT_EGC
-    if (src->nech > 0) {
-        return cell_set(dst, src->ech, src->nech, src->fg, src->bg);
+    if (c->nclusters > 0) {
+        for (i = 0; i < n; i++) {
+            c->ech[i].nech = 0;
+        }
+        c->nclusters = 0;
     }
 #endif
-    return cell_set(dst, &src->ch, 1, src->fg, src->bg);
+    return TB_OK;
+}
+
+static int cellbuf_index(struct cellbuf_t *c, int x, int y, size_t *out) {
+    if (x < 0 || x >= c->width || y < 0 || y >= c->height) {
+        *out = 0;
+        return TB_ERR_OUT_OF_BOUNDS;
+    }
+    *out = (size_t)y * c->width + x;
+    return TB_OK;
 }
 
-static int cell_set(struct tb_cell *cell, uint32_t *ch, size_t nch,
+static int cellbuf_set(struct cellbuf_t *c, size_t i, uint32_t *ch, size_t nch,
     uintattr_t fg, uintattr_t bg) {
-    cell->ch = ch ? *ch : 0;
-    cell->fg = fg;
-    cell->bg = bg;
+    c->ch[i] = ch ? *ch : 0;
+    c->fg[i] = fg;
+    c->bg[i] = bg;
 #ifdef TB_OPT_EGC
     if (nch <= 1) {
-        cell->nech = 0;
+        if (c->ech && c->ech[i].nech > 0) {
+            c->ech[i].nech = 0;
+            c->nclusters--;
+        }
     } else {
         int rv;
-        if_err_return(rv, cell_reserve_ech(cell, nch + 1));
-        memcpy(cell->ech, ch, nch);
-        cell->ech[nch] = '\0';
-        cell->nech = nch;
+        if_err_return(rv, cellbuf_reserve_ech(c, i, nch + 1));
+        if (c->ech[i].nech == 0) {
+            c->nclusters++;
+        }
+        memcpy(c->ech[i].ech, ch, nch * sizeof(*ch));
+        c->ech[i].ech[nch] = '\0';
+        c->ech[i].nech = nch;
     }
 #else
     (void)nch;
-    (void)cell_reserve_ech;
+    (void)cellbuf_reserve_ech;
 #endif
     return TB_OK;
 }
 
-static int cell_reserve_ech(struct tb_cell *cell, size_t n) {
+static int cellbuf_reserve_ech(struct cellbuf_t *c, size_t i, size_t n) {
 #ifdef TB_OPT_EGC
+    struct cellbuf_ech_t *cell;
+    if (!c->ech) {
+        size_t ncells = (size_t)c->width * c->height;
+        if (!(c->ech = tb_malloc(sizeof(*c->ech) * ncells))) {
+            return TB_ERR_MEM;
+        }
+        memset(c->ech, 0, sizeof(*c->ech) * ncells);
+    }
+    cell = &c->ech[i];
     if (cell->cech >= n) {
         return TB_OK;
     }
-    if (!(cell->ech = tb_realloc(cell->ech, n * sizeof(cell->ch)))) {
+    if (!(cell->ech = tb_realloc(cell->ech, n * sizeof(*cell->ech)))) {
         return TB_ERR_MEM;
     }
     cell->cech = n;
     return TB_OK;
 #else
-    (void)cell;
+    (void)c;
+    (void)i;
     (void)n;
     return TB_ERR;
 #endif
 }
 
-static int cell_free(struct tb_cell *cell) {
+static int cellbuf_cmp(struct cellbuf_t *a, struct cellbuf_t *b, size_t i) {
+    if (a->ch[i] != b->ch[i] || a->fg[i] != b->fg[i] || a->bg[i] != b->bg[i]) {
+        return 1;
+    }
 #ifdef TB_OPT_EGC
-    if (cell->ech) {
-        tb_free(cell->ech);
+    size_t na = a->ech ? a->ech[i].nech : 0;
+    size_t nb = b->ech ? b->ech[i].nech : 0;
+    if (na != nb) {
+        return 1;
+    } else if (na > 0) { // na == nb
+        return memcmp(a->ech[i].ech, b->ech[i].ech, na * sizeof(uint32_t));
     }
 #endif
-    memset(cell, 0, sizeof(*cell));
-    return TB_OK;
-}
-
-static int cellbuf_init(struct cellbuf_t *c, int w, int h) {
-    c->cells = tb_malloc(sizeof(struct tb_cell) * w * h);
-    if (!c->cells) {
-        return TB_ERR_MEM;
-    }
-    memset(c->cells, 0, sizeof(struct tb_cell) * w * h);
-    c->width = w;
-    c->height = h;
-    return TB_OK;
-}
-
-static int cellbuf_free(struct cellbuf_t *c) {
-    if (c->cells) {
-        int i;
-        for (i = 0; i < c->width * c->height; i++) {
-            cell_free(&c->cells[i]);
-        }
-        tb_free(c->cells);
-    }
-    memset(c, 0, sizeof(*c));
-    return TB_OK;
+    return 0;
 }
 
-static int cellbuf_clear(struct cellbuf_t *c) {
-    int rv, i;
-    uint32_t space = (uint32_t)' ';
-    for (i = 0; i < c->width * c->height; i++) {
-        if_err_return(rv,
-            cell_set(&c->cells[i], &space, 1, global.fg, global.bg));
+static int cellbuf_copy(struct cellbuf_t *dst, struct cellbuf_t *src,
+    size_t i) {
+#ifdef TB_OPT_EGC
+    if (src->ech && src->ech[i].nech > 0) {
+        return cellbuf_set(dst, i, src->ech[i].ech, src->ech[i].nech,
+            src->fg[i], src->bg[i]);
     }
-    return TB_OK;
+#endif
+    return cellbuf_set(dst, i, &src->ch[i], 1, src->fg[i], src->bg[i]);
 }
 
-static int cellbuf_get(struct cellbuf_t *c, int x, int y,
-    struct tb_cell **out) {
-    if (x < 0 || x >= c->width || y < 0 || y >= c->height) {
-        *out = NULL;
-        return TB_ERR_OUT_OF_BOUNDS;
+static size_t cellbuf_next(struct cellbuf_t *back, struct cellbuf_t *front,
+    size_t i, size_t end) {
+    // Index of the first cell in [i, end) that differs between the buffers
+    // or may be wide, which tb_present() must step over. Cells in between
+    // are unchanged and 1 column wide. Grapheme clusters are compared cell by
+    // cell, only while either buffer holds one.
+    size_t n = end - i;
+#ifdef TB_OPT_EGC
+    if (back->nclusters > 0 || front->nclusters > 0) {
+        return i;
     }
-    *out = &c->cells[(y * c->width) + x];
-    return TB_OK;
+#endif
+    n = diff_index(&back->ch[i], &front->ch[i], n, sizeof(*back->ch));
+    n = diff_index(&back->fg[i], &front->fg[i], n, sizeof(*back->fg));
+    n = diff_index(&back->bg[i], &front->bg[i], n, sizeof(*back->bg));
+    n = wide_index(&back->ch[i], n);
+    return i + n;
 }
 
 static int cellbuf_resize(struct cellbuf_t *c, int w, int h) {
@@ -3199,23 +4479,61 @@ static int cellbuf_resize(struct cellbuf_t *c, int w, int h) {
     int minw = (w < ow) ? w : ow;
     int minh = (h < oh) ? h : oh;
 
-    struct tb_cell *prev = c->cells;
+    struct cellbuf_t prev = *c;
 
     if_err_return(rv, cellbuf_init(c, w, h));
     if_err_return(rv, cellbuf_clear(c));
 
-    int x, y;
-    for (x = 0; x < minw; x++) {
-        for (y = 0; y < minh; y++) {
-            struct tb_cell *src, *dst;
-            src = &prev[(y * ow) + x];
-            if_err_return(rv, cellbuf_get(c, x, y, &dst));
-            if_err_return(rv, cell_copy(dst, src));
+    int y;
+    for (y = 0; y < minh; y++) {
+        size_t src = (size_t)y * ow, dst = (size_t)y * w;
+        memcpy(&c->ch[dst], &prev.ch[src], sizeof(*c->ch) * minw);
+        memcpy(&c->fg[dst], &prev.fg[src], sizeof(*c->fg) * minw);
+        memcpy(&c->bg[dst], &prev.bg[src], sizeof(*c->bg) * minw);
+#ifdef TB_OPT_EGC
+        int x;
+        for (x = 0; prev.ech && x < minw; x++) {
+            if (prev.ech[src + x].nech > 0) {
+                if_err_return(rv,
+                    cellbuf_set(c, dst + x, prev.ech[src + x].ech,
+                        prev.ech[src + x].nech, prev.fg[src + x],
+                        prev.bg[src + x]));
+            }
         }
+#endif
     }
 
-    tb_free(prev);
+    cellbuf_free(&prev);
+
+    return TB_OK;
+}
+
+static int cellbuf_assign(struct cellbuf_t *dst, struct cellbuf_t *src) {
+    // Make dst a copy of src, reusing its memory when the sizes match
+    int rv;
+    size_t i, n = (size_t)src->width * src->height;
 
+    if (dst->width != src->width || dst->height != src->height) {
+        cellbuf_free(dst);
+        if_err_return(rv, cellbuf_init(dst, src->width, src->height));
+    }
+    memcpy(dst->ch, src->ch, sizeof(*dst->ch) * n);
+    memcpy(dst->fg, src->fg, sizeof(*dst->fg) * n);
+    memcpy(dst->bg, src->bg, sizeof(*dst->bg) * n);
+    memcpy(dst->dirty, src->dirty, dst->height);
+#ifdef TB_OPT_EGC
+    for (i = 0; dst->nclusters > 0 && i < n; i++) {
+        dst->ech[i].nech = 0;
+    }
+    dst->nclusters = 0;
+    for (i = 0; src->nclusters > 0 && i < n; i++) {
+        if (src->ech[i].nech > 0) {
+            if_err_return(rv, cellbuf_copy(dst, src, i));
+        }
+    }
+#else
+    (void)i;
+#endif
     return TB_OK;
 }
 
@@ -3246,7 +4564,9 @@ static int bytebuf_flush(struct bytebuf_t *b, int fd) {
     if (b->len <= 0) {
         return TB_OK;
     }
+    long long trace_start = tb_trace_begin();
     ssize_t write_rv = write(fd, b->buf, b->len);
+    tb_trace_end("flush", trace_start);
     if (write_rv < 0 || (size_t)write_rv != b->len) {
         // Note, errno will be 0 on partial write
         global.last_errno = errno;
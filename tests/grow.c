@@ -0,0 +1,112 @@
+// see LICENSE file for copyright and license details
+//
+// a deck of more than 4 GB, sparse but for a line end every MB and slides
+// past 2 and 4 GB, is read in window mode with its slides at their offsets
+
+#define main gmip_main
+#include "../gmip.c"
+#undef main
+
+#define MB                          ((off_t) 1 << 20)
+#define FIRST                       "# first\nhello\n---\n"
+#define PAST_2GB                    "---\n# past 2 GB\nline two\n---\n"
+#define PAST_4GB                    "---\n# past 4 GB\nline four\n"
+
+int write_at(int fd, off_t at, const char *chars);
+int check_line(const struct line *l, const char *chars);
+
+int
+write_at(int fd, off_t at, const char *chars)
+{
+    // write chars at offset at of the deck, return 0 on success
+
+    return pwrite(fd, chars, strlen(chars), at) != (ssize_t) strlen(chars);
+}
+
+int
+check_line(const struct line *l, const char *chars)
+{
+    // tell if line l exists and holds chars
+
+    return l != NULL && !strcmp(l->chars, chars);
+}
+
+int
+main(void)
+{
+    struct slide *buf = NULL;
+    char path[] = "/tmp/gmip-grow-XXXXXX", *filename = path;
+    off_t two = ((off_t) 2 << 30) + MB, four = ((off_t) 4 << 30) + MB, at;
+    size_t end = (size_t) four + strlen(PAST_4GB);
+    const struct slide *s;
+    int fd, failed = 0;
+
+    if (sizeof(size_t) < 8) {
+        // 32-bit address space, the deck can not be mapped
+        printf("grow: %zu-bit sizes, skipped\n", 8*sizeof(size_t));
+        return 0;
+    }
+
+    // the deck, its last MB of zeros before each slide ended by a line end
+    if ((fd = mkstemp(path)) < 0)
+        return 1;
+    unlink(path);
+    if (ftruncate(fd, end) < 0) {
+        printf("grow: no sparse file of %zu bytes, skipped\n", end);
+        return 0;
+    }
+    if (write_at(fd, 0, FIRST) || write_at(fd, two, PAST_2GB) ||
+        write_at(fd, four, PAST_4GB))
+        return 1;
+    for (at = MB; at <= four; at += MB)
+        if (write_at(fd, at - 1, "\n"))
+            return 1;
+    snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+
+    window_cap = MB;
+    strcpy(title, DEFAULT_TITLE);
+    strcpy(author, DEFAULT_AUTHOR);
+    parse_open(path);
+    while (!parse_more())
+        ;
+    sync_deck(&buf);
+
+    // slides of text, then of zeros
+    if (parser.map_size != end || nb_slides != 5 || buf[0].offset != 0 ||
+        buf[1].offset != strlen(FIRST) || buf[2].offset != (size_t) two + 4 ||
+        buf[3].offset != (size_t) two + strlen(PAST_2GB) ||
+        buf[4].offset != (size_t) four + 4 || buf[5].offset != end) {
+        fprintf(stderr, "grow: %d slides read from %zu bytes at %zu, %zu, "
+            "%zu, %zu, %zu and %zu\n", nb_slides, parser.map_size,
+            buf[0].offset, buf[1].offset, buf[2].offset, buf[3].offset,
+            buf[4].offset, buf[5].offset);
+        failed = 1;
+    }
+
+    // their headings point into the mapped deck
+    if (nb_headings != 3 || headings[1].slide != 2 || headings[2].slide != 4 ||
+        headings[1].chars != &(parser.map[two + 6]) ||
+        headings[2].chars != &(parser.map[four + 6])) {
+        fprintf(stderr, "grow: %d headings, not at offsets %zu and %zu\n",
+            nb_headings, (size_t) two + 6, (size_t) four + 6);
+        failed = 1;
+    }
+
+    // and their lines are loaded from there
+    s = load_slide(buf, 2);
+    if (!check_line(s->start, "# past 2 GB") ||
+        !check_line(s->start->next, "line two") ||
+        s->start->next->next != NULL) {
+        fprintf(stderr, "grow: lines of the slide past 2 GB not loaded\n");
+        failed = 1;
+    }
+    s = load_slide(buf, 4);
+    if (!check_line(s->start, "# past 4 GB") ||
+        !check_line(s->start->next, "line four") ||
+        s->start->next->next != NULL) {
+        fprintf(stderr, "grow: lines of the slide past 4 GB not loaded\n");
+        failed = 1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,231 @@
+// see LICENSE file for copyright and license details
+//
+// once every slide was seen, navigating allocates nothing: 10000 keys typed
+// in a terminal, going through display_slide(), render_step() and presenting
+// frames as main() does, leave the allocation counts of every subsystem
+// unchanged
+
+#define _GNU_SOURCE
+#define main gmip_main
+#include "../gmip.c"
+#undef main
+
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#define NB_SLIDES                   24
+#define NB_KEYS                     10000
+#define BATCH                       4   // keys typed at once, then a pause
+#define IDLE_MS                     200 // of no output once keys are handled
+#define SWEEP                       (1 + 2*20 + 2*4)    // keys for a step
+
+void snapshot(int sig);
+int pump(int master, int ms);
+void type(int master, const char *keys, size_t len);
+void random_keys(int master, unsigned seed);
+int take_snapshot(int master, pid_t pid, int ready);
+int run(const char *path, int slave, int ready);
+
+struct mem_stats snapshots[2][NB_MEM_TAGS + 1];
+int nb_snapshots, ready_fd;
+
+void
+snapshot(int sig)
+{
+    // copy the allocation counts, gmip being idle
+
+    if (nb_snapshots < 2)
+        memcpy(snapshots[nb_snapshots++], mem, sizeof(mem));
+    write(ready_fd, &sig, 1);
+}
+
+int
+pump(int master, int ms)
+{
+    // read what gmip writes for up to ms milliseconds, answering the device
+    // attributes query of termbox, return 1 if anything was written
+
+    static char tail[2];
+    char chars[4096], *c;
+    struct pollfd fd = {master, POLLIN, 0};
+    ssize_t n;
+    int written = 0;
+
+    while (poll(&fd, 1, ms) > 0 && (n = read(master, chars, sizeof(chars)))
+        > 0) {
+        written = 1;
+        for (c = chars; c < &(chars[n]); c++) {
+            if (tail[0] == '\x1b' && tail[1] == '[' && *c == 'c')
+                write(master, "\x1b[?62c", 6);
+            tail[0] = tail[1];
+            tail[1] = *c;
+        }
+    }
+
+    return written;
+}
+
+void
+type(int master, const char *keys, size_t len)
+{
+    // type keys a few at a time, letting steps be rendered ahead between
+    // them, then wait for gmip to be idle
+
+    size_t k;
+
+    for (k = 0; k < len; k += BATCH) {
+        write(master, &(keys[k]), MIN(BATCH, len - k));
+        pump(master, 1);
+    }
+    while (pump(master, IDLE_MS))
+        ;
+}
+
+void
+random_keys(int master, unsigned seed)
+{
+    // type NB_KEYS navigation keys from the first slide
+
+    static const char moves[] = "jkJKlhLH";
+    char keys[NB_KEYS];
+    int k;
+
+    for (k = 0; k < NB_KEYS; k++) {
+        seed = seed*1103515245 + 12345;
+        keys[k] = moves[(seed >> 16) % (sizeof(moves) - 1)];
+    }
+    type(master, "g", 1);
+    type(master, keys, NB_KEYS);
+}
+
+int
+take_snapshot(int master, pid_t pid, int ready)
+{
+    // have gmip copy its allocation counts, return 0 once done
+
+    char c;
+    struct pollfd fd = {ready, POLLIN, 0};
+
+    if (kill(pid, SIGUSR1) < 0)
+        return 1;
+    while (poll(&fd, 1, 0) == 0)
+        pump(master, 1);
+
+    return read(ready, &c, 1) != 1;
+}
+
+int
+run(const char *path, int slave, int ready)
+{
+    // run gmip on path in the terminal of slave, counting allocations, then
+    // compare the counts of both snapshots
+
+    static const char *names[NB_MEM_TAGS + 1] = {"parse", "layout",
+        "render", "trace", "search", "syntax", "total"};
+    char *argv[] = {"gmip", (char *) path, NULL};
+    const struct mem_stats *a = snapshots[0], *b = snapshots[1];
+    int i, failed = 0;
+
+    if (setsid() < 0 || ioctl(slave, TIOCSCTTY, 0) < 0)
+        return 1;
+    ready_fd = ready;
+    signal(SIGUSR1, snapshot);
+    mem_stats = 1;
+    setenv("TERM", "xterm", 1);
+    gmip_main(2, argv);
+
+    if (nb_snapshots != 2)
+        return 1;
+    for (i = 0; i <= NB_MEM_TAGS; i++) {
+        if (a[i].allocs == b[i].allocs && a[i].frees == b[i].frees)
+            continue;
+        fprintf(stderr, "navigate: %llu %s allocations and %llu frees for "
+            "%d keys\n", (unsigned long long) (b[i].allocs - a[i].allocs),
+            names[i], (unsigned long long) (b[i].frees - a[i].frees),
+            NB_KEYS);
+        failed = 1;
+    }
+
+    return failed;
+}
+
+int
+main(void)
+{
+    struct winsize ws = {24, 80, 0, 0};
+    char path[] = "/tmp/gmip-navigate-XXXXXX";
+    static char sweep[8 * NB_SLIDES * SWEEP];
+    char *k;
+    pid_t pid;
+    FILE *f;
+    int fd, master, slave, ready[2], status, i, j;
+
+    // slides of every kind, some taller or wider than the screen
+    if ((fd = mkstemp(path)) < 0 || (f = fdopen(fd, "w")) == NULL)
+        return 1;
+    for (i = 0; i < NB_SLIDES; i++) {
+        fprintf(f, "%s# slide %d\n", i ? "---\n" : "", i);
+        for (j = 0; j <= i; j++) {
+            switch (i % 4) {
+            case 0:
+                fprintf(f, "* item %d\n^\n", j);
+                break;
+            case 1:
+                fprintf(f, "words %d of a paragraph long enough to be "
+                    "wrapped over a few rows of the screen\n", j);
+                break;
+            case 2:
+                fprintf(f, "caf\xc3\xa9 e\xcc\x81 \xe6\xbc\xa2\xe5\xad\x97 "
+                    "%d wide and combining characters\n", j);
+                break;
+            default:
+                fprintf(f, "```c\nint line%d = %d; /* preformatted, wider "
+                    "than the screen and scrolled, in a block of code "
+                    "highlighted */\n```\n", j, j);
+            }
+        }
+    }
+    if (fclose(f) != 0)
+        return 1;
+
+    // a terminal, and a pipe telling counts were copied
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+        grantpt(master) < 0 || unlockpt(master) < 0 ||
+        (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0 ||
+        ioctl(master, TIOCSWINSZ, &ws) < 0 || pipe(ready) < 0)
+        return 1;
+    if ((pid = fork()) < 0)
+        return 1;
+    if (pid == 0) {
+        close(master);
+        close(ready[0]);
+        exit(run(path, slave, ready[1]));
+    }
+    close(slave);
+    close(ready[1]);
+    pump(master, IDLE_MS);
+
+    // every slide, part and scrolled position seen, then keys at random
+    for (k = sweep; k < &(sweep[sizeof(sweep)]); k += SWEEP) {
+        k[0] = 'j';
+        memset(&(k[1]), 'J', 20);
+        memset(&(k[1 + 20]), 'K', 20);
+        memset(&(k[1 + 2*20]), 'L', 4);
+        memset(&(k[1 + 2*20 + 4]), 'H', 4);
+    }
+    type(master, "g", 1);
+    type(master, sweep, sizeof(sweep));
+    random_keys(master, 1);
+
+    if (take_snapshot(master, pid, ready[0]))
+        return 1;
+    random_keys(master, 2);
+    if (take_snapshot(master, pid, ready[0]))
+        return 1;
+    type(master, "q", 1);
+    unlink(path);
+    if (waitpid(pid, &status, 0) < 0)
+        return 1;
+
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
@@ -0,0 +1,130 @@
+// see LICENSE file for copyright and license details
+//
+// stepping through the parts of a slide only draws and writes the rows
+// revealed or hidden: the bytes sent to the terminal grow with the number of
+// those rows
+
+#define _GNU_SOURCE
+#define main gmip_main
+#include "../gmip.c"
+#undef main
+
+#include <sys/ioctl.h>
+
+#define DECK \
+    "## Reveal\n" \
+    "row shown from the start, 0\n" \
+    "row shown from the start, 1\n" \
+    "^\n" \
+    "row revealed by a step, 2\n" \
+    "^\n" \
+    "row revealed by a step, 3\n" \
+    "row revealed by a step, 4\n" \
+    "row revealed by a step, 5\n"
+#define ROW_CELLS                   20  // non-blank cells of a row
+
+void *drain(void *arg);
+int show_parts(struct slide *buf, int parts, size_t *bytes, int *cells);
+
+void *
+drain(void *arg)
+{
+    // read what is written to the terminal, so that writes never block
+
+    char chars[4096];
+
+    while (read(*(int *) arg, chars, sizeof(chars)) > 0)
+        ;
+
+    return NULL;
+}
+
+int
+show_parts(struct slide *buf, int parts, size_t *bytes, int *cells)
+{
+    // display parts of the first slide, as main() does, get what was written
+    // for it and return the number of rows drawn
+
+    int scroll = 0, hscroll = 0, rows, y;
+    size_t pending;
+
+    // once the writer took the last frame, not to have it merged in
+    do {
+        pthread_mutex_lock(&global.writer_mutex);
+        pending = global.pending.len;
+        pthread_mutex_unlock(&global.writer_mutex);
+    } while (pending > 0 && usleep(1000) == 0);
+    display_slide(*load_slide(buf, 0), 1, parts, &scroll, &hscroll);
+    for (rows = y = 0; y < global.back.height; y++)
+        rows += global.back.dirty[y];
+    tb_present();
+    tb_present_stats(bytes, cells);
+
+    return rows;
+}
+
+int
+main(void)
+{
+    struct winsize ws = {24, 80, 0, 0};
+    struct slide *buf = NULL;
+    char path[] = "/tmp/gmip-reveal-XXXXXX", *filename = path;
+    size_t full, one, three, hide;
+    int fd, master, slave, cells, cells_one, cells_three, failed = 0;
+    int rows_one, rows_three, rows_hide;
+    pthread_t reader;
+
+    // a deck, and a terminal nobody answers on
+    if ((fd = mkstemp(path)) < 0 || write(fd, DECK, strlen(DECK)) < 0)
+        return 1;
+    close(fd);
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+        grantpt(master) < 0 || unlockpt(master) < 0 ||
+        (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0 ||
+        ioctl(master, TIOCSWINSZ, &ws) < 0)
+        return 1;
+    pthread_create(&reader, NULL, drain, &master);
+    setenv("TERM", "xterm", 1);
+
+    strcpy(title, DEFAULT_TITLE);
+    strcpy(author, DEFAULT_AUTHOR);
+    parse_open(path);
+    while (!parse_more())
+        ;
+    sync_deck(&buf);
+    unlink(path);
+    tb_init_fd(slave);
+    tb_set_output_mode(OUTPUT_MODE);
+    tb_set_clear_attrs(COLOR_DEFAULT, COLOR_BG);
+    resize(tb_width(), tb_height());
+
+    show_parts(buf, 1, &full, &cells);
+    rows_one = show_parts(buf, 2, &one, &cells_one);
+    rows_three = show_parts(buf, 3, &three, &cells_three);
+    rows_hide = show_parts(buf, 2, &hide, &cells);
+    tb_shutdown();
+
+    if (rows_one != 1 || rows_three != 3 || rows_hide != 3) {
+        fprintf(stderr, "reveal: %d, %d and %d rows drawn to reveal 1 and 3 "
+            "rows and hide 3\n", rows_one, rows_three, rows_hide);
+        failed = 1;
+    }
+
+    // only the characters of the revealed rows are written, and about as
+    // many bytes per row
+    if (cells_one != ROW_CELLS || cells_three != 3*ROW_CELLS) {
+        fprintf(stderr, "reveal: %d and %d cells written for 1 and 3 rows, "
+            "not %d and %d\n", cells_one, cells_three, ROW_CELLS,
+            3*ROW_CELLS);
+        failed = 1;
+    }
+    if (one == 0 || three < 2*one || three > 3*one || hide > 3*one ||
+        full < 4*three) {
+        fprintf(stderr, "reveal: %zu bytes for the first frame, %zu, %zu "
+            "and %zu to reveal 1 and 3 rows and hide 3\n", full, one, three,
+            hide);
+        failed = 1;
+    }
+
+    return failed;
+}